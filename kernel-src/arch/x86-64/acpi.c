@@ -56,7 +56,7 @@ void arch_acpi_init() {
 		__assert(arch_acpi_checksumok(rsdt));
 
 		headercount = (rsdt->header.length - sizeof(sdtheader_t)) / sizeof(uint32_t);
-		headers = alloc(sizeof(sdtheader_t *) * headercount);
+		headers = zalloc(sizeof(sdtheader_t *) * headercount);
 		__assert(headers);
 
 		// TODO map according to the header length entry
@@ -71,7 +71,7 @@ void arch_acpi_init() {
 		__assert(arch_acpi_checksumok(xsdt));
 
 		headercount = (xsdt->header.length - sizeof(sdtheader_t)) / sizeof(uint64_t);
-		headers = alloc(sizeof(sdtheader_t *) * headercount);
+		headers = zalloc(sizeof(sdtheader_t *) * headercount);
 		__assert(headers);
 
 		for (size_t i = 0; i < headercount; ++i) {
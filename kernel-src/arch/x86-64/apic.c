@@ -313,7 +313,7 @@ void arch_apic_init() {
 
 	// map I/O apics to memory
 
-	ioapics = alloc(sizeof(ioapicdesc_t) * iocount);
+	ioapics = zalloc(sizeof(ioapicdesc_t) * iocount);
 	__assert(ioapics);
 
 	for (int i = 0; i < iocount; ++i) {
@@ -38,6 +38,7 @@
 #include <kernel/tty.h>
 #include <kernel/pty.h>
 #include <kernel/vmmcache.h>
+#include <kernel/shrinker.h>
 
 static cpu_t bsp_cpu;
 
@@ -49,6 +50,7 @@ void kernel_entry() {
 	arch_idt_setup();
 	arch_idt_reload();
 	dpc_init();
+	shrinker_init();
 	pmm_init();
 	term_init();
 	logging_sethook(term_putchar);
@@ -7,6 +7,7 @@
 #include <kernel/vmm.h>
 #include <arch/cpu.h>
 #include <arch/smp.h>
+#include <cpuid.h>
 
 #define ADDRMASK (uint64_t)0x7ffffffffffff000
 #define   PTMASK (uint64_t)0b111111111000000000000
@@ -16,6 +17,24 @@
 
 #define INTERMEDIATE_FLAGS ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_USER
 
+// set in pdpt and pd entries that map a 1gb or 2mb page instead of pointing to a table
+#define LARGEPAGE (1 << 7)
+#define PAGE_SIZE_2MB ((uintptr_t)1 << 21)
+#define PAGE_SIZE_1GB ((uintptr_t)1 << 30)
+
+#define CPUID_1GBPAGES (1 << 26)
+#define CPUID_PCID (1 << 17)
+
+// kernel mappings are the same in every address space, so they are kept in the tlb across switches
+#define GLOBALPAGE (1 << 8)
+
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+
+// pcids 1 to PCID_COUNT are given out round robin on each cpu, 0 is left for the boot page table
+#define PCID_COUNT 8
+
 // returns hhdm address of next entry
 
 static inline uint64_t* next(uint64_t entry) {
@@ -28,9 +47,10 @@ static inline uint64_t* next(uint64_t entry) {
 #define DEPTH_PD 2
 #define DEPTH_PT 3
 
-// returns pointer to the entry
+// returns pointer to the leaf entry mapping vaddr, which can be a 1gb or 2mb page.
+// if size isn't NULL, the size of the page mapped by the entry is returned in it
 
-static uint64_t *get_page(pagetableptr_t top, void *vaddr) {
+static uint64_t *get_leaf(pagetableptr_t top, void *vaddr, uintptr_t *size) {
 	uint64_t *pml4 = MAKE_HHDM(top);
 	uintptr_t addr = (uintptr_t)vaddr;
 	uintptr_t ptoffset = (addr & PTMASK) >> 12;
@@ -42,17 +62,35 @@ static uint64_t *get_page(pagetableptr_t top, void *vaddr) {
 	if (pdpt == NULL)
 		return NULL;
 
+	if (pdpt[pdptoffset] & LARGEPAGE) {
+		if (size)
+			*size = PAGE_SIZE_1GB;
+		return pdpt + pdptoffset;
+	}
+
 	uint64_t *pd = next(pdpt[pdptoffset]);
 	if (pd == NULL)
 		return NULL;
+
+	if (pd[pdoffset] & LARGEPAGE) {
+		if (size)
+			*size = PAGE_SIZE_2MB;
+		return pd + pdoffset;
+	}
 	
 	uint64_t *pt = next(pd[pdoffset]);
 	if (pt == NULL)
 		return NULL;
 
+	if (size)
+		*size = PAGE_SIZE;
 	return pt + ptoffset;
 }
 
+static uint64_t *get_page(pagetableptr_t top, void *vaddr) {
+	return get_leaf(top, vaddr, NULL);
+}
+
 // inserts an entry
 
 static bool add_page(pagetableptr_t top, void *vaddr, uint64_t entry, int depth) {
@@ -70,12 +108,11 @@ static bool add_page(pagetableptr_t top, void *vaddr, uint64_t entry, int depth)
 
 	uint64_t *pdpt = next(pml4[pml4offset]);
 	if (pdpt == NULL) {
-		pdpt = pmm_allocpage(PMM_SECTION_DEFAULT);
+		pdpt = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 		if (pdpt == NULL)
 			return false;
 		pml4[pml4offset] = (uint64_t)pdpt | INTERMEDIATE_FLAGS;
 		pdpt = MAKE_HHDM(pdpt);
-		memset(pdpt, 0, PAGE_SIZE);
 	}
 	
 	if (depth == DEPTH_PD) {
@@ -83,14 +120,15 @@ static bool add_page(pagetableptr_t top, void *vaddr, uint64_t entry, int depth)
 		return true;
 	}
 	
+	// can't map a smaller page inside of a large one
+	__assert((pdpt[pdptoffset] & LARGEPAGE) == 0);
 	uint64_t *pd = next(pdpt[pdptoffset]);
 	if (pd == NULL) {
-		pd = pmm_allocpage(PMM_SECTION_DEFAULT);
+		pd = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 		if (pd == NULL)
 			return false;
 		pdpt[pdptoffset] = (uint64_t)pd | INTERMEDIATE_FLAGS;
 		pd = MAKE_HHDM(pd);
-		memset(pd, 0, PAGE_SIZE);
 	}
 	
 	if (depth == DEPTH_PT) {
@@ -98,14 +136,14 @@ static bool add_page(pagetableptr_t top, void *vaddr, uint64_t entry, int depth)
 		return true;
 	}
 	
+	__assert((pd[pdoffset] & LARGEPAGE) == 0);
 	uint64_t *pt = next(pd[pdoffset]);
 	if (pt == NULL) {
-		pt = pmm_allocpage(PMM_SECTION_DEFAULT);
+		pt = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 		if (pt == NULL)
 			return false;
 		pd[pdoffset] = (uint64_t)pt | INTERMEDIATE_FLAGS;
 		pt = MAKE_HHDM(pt);
-		memset(pt, 0, PAGE_SIZE);
 	}
 
 	pt[ptoffset] = entry;
@@ -119,7 +157,7 @@ static void destroy(uint64_t *table, int depth) {
 		if (addr == NULL)
 			continue;
 
-		if (depth > 0)
+		if (depth > 0 && (table[i] & LARGEPAGE) == 0)
 			destroy(MAKE_HHDM(addr), depth - 1);
 
 		pmm_release(addr);
@@ -132,7 +170,7 @@ void arch_mmu_destroytable(pagetableptr_t table) {
 }
 
 bool arch_mmu_map(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags) {
-	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags;
+	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags | (vaddr >= KERNELSPACE_START ? GLOBALPAGE : 0);
 	return add_page(table, vaddr, entry, 0);
 }
 
@@ -154,15 +192,19 @@ void arch_mmu_remap(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t f
 	if (entryptr == NULL)
 		return;
 	uintptr_t addr = paddr == NULL ? (*entryptr & ADDRMASK) : ((uintptr_t)paddr & ADDRMASK);
-	*entryptr = addr | flags;
+	*entryptr = addr | flags | (*entryptr & (LARGEPAGE | GLOBALPAGE));
 	arch_mmu_invalidate(vaddr);
 }
 
 void *arch_mmu_getphysical(pagetableptr_t table, void *vaddr) {
-	uint64_t *entry = get_page(table, vaddr);
+	uintptr_t size;
+	uint64_t *entry = get_leaf(table, vaddr, &size);
 	if (entry == NULL)
 		return NULL;
-	return (void *)(*entry & ADDRMASK);
+
+	// for large pages, return the address of the 4k page inside of it
+	uintptr_t offset = (uintptr_t)vaddr & (size - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	return (void *)((*entry & ADDRMASK & ~(size - 1)) + offset);
 }
 
 bool arch_mmu_ispresent(pagetableptr_t table, void *vaddr) {
@@ -182,8 +224,167 @@ bool arch_mmu_isdirty(pagetableptr_t table, void *vaddr) {
 	return entry == NULL ? false : *entry & ARCH_MMU_FLAGS_DIRTY;
 }
 
-void arch_mmu_switch(pagetableptr_t table) {
-	asm volatile("mov %%rax, %%cr3" : : "a"(table));
+#define ARCH_MMU_FLAGS_ACCESSED (1 << 5)
+
+bool arch_mmu_isaccessed(pagetableptr_t table, void *vaddr) {
+	uint64_t *entry = get_page(table, vaddr);
+	return entry == NULL ? false : *entry & ARCH_MMU_FLAGS_ACCESSED;
+}
+
+// returns whether the page was accessed and clears the bit. the tlb isn't flushed, a cpu that still has the
+// entry cached won't set the bit again until it loses it, which only makes the page look colder than it is
+bool arch_mmu_clearaccessed(pagetableptr_t table, void *vaddr) {
+	uint64_t *entry = get_page(table, vaddr);
+	if (entry == NULL)
+		return false;
+
+	return __atomic_fetch_and(entry, ~(uint64_t)ARCH_MMU_FLAGS_ACCESSED, __ATOMIC_SEQ_CST) & ARCH_MMU_FLAGS_ACCESSED;
+}
+
+// huge pages are 2mb leaves in a pd. they can only be mapped where there isn't a page table yet
+
+bool arch_mmu_canmaphuge(pagetableptr_t table, void *vaddr) {
+	return get_page(table, vaddr) == NULL;
+}
+
+bool arch_mmu_maphuge(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags) {
+	__assert(((uintptr_t)paddr & (PAGE_SIZE_2MB - 1)) == 0 && ((uintptr_t)vaddr & (PAGE_SIZE_2MB - 1)) == 0);
+	if (arch_mmu_canmaphuge(table, vaddr) == false)
+		return false;
+
+	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags | LARGEPAGE;
+	return add_page(table, vaddr, entry, DEPTH_PT);
+}
+
+bool arch_mmu_ishuge(pagetableptr_t table, void *vaddr) {
+	uintptr_t size;
+	uint64_t *entry = get_leaf(table, vaddr, &size);
+	return entry && size == PAGE_SIZE_2MB;
+}
+
+// replaces a 2mb pd entry with a page table mapping the same memory, without invalidating it
+static bool split(uint64_t *entry) {
+	uint64_t *pt = pmm_allocpage(PMM_SECTION_DEFAULT);
+	if (pt == NULL)
+		return false;
+
+	uintptr_t base = *entry & ADDRMASK & ~(PAGE_SIZE_2MB - 1);
+	uint64_t flags = *entry & ~ADDRMASK & ~(uint64_t)LARGEPAGE;
+	uint64_t *ptentries = MAKE_HHDM(pt);
+	for (int i = 0; i < PAGE_SIZE_2MB / PAGE_SIZE; ++i)
+		ptentries[i] = (base + i * PAGE_SIZE) | flags;
+
+	*entry = (uint64_t)pt | INTERMEDIATE_FLAGS;
+	return true;
+}
+
+// replaces the huge page containing vaddr with a page table mapping the same memory.
+// returns false if there was no memory for the page table
+bool arch_mmu_splithuge(pagetableptr_t table, void *vaddr) {
+	uintptr_t size;
+	uint64_t *entry = get_leaf(table, vaddr, &size);
+	if (entry == NULL || size != PAGE_SIZE_2MB)
+		return true;
+
+	if (split(entry) == false)
+		return false;
+
+	arch_mmu_invalidate(vaddr);
+	return true;
+}
+
+static int levelshift[4] = {39, 30, 21, 12};
+
+// copies the entries of src in the part of [start, end) covered by the table into dst.
+// level 0 is the pml4, level 3 a page table
+static bool copytable(uint64_t *dst, uint64_t *src, uintptr_t base, uintptr_t start, uintptr_t end, int level, mmuflags_t flags) {
+	uintptr_t entrysize = (uintptr_t)1 << levelshift[level];
+	int first = start > base ? (start - base) >> levelshift[level] : 0;
+	int last = end - base >= entrysize * 512 ? 511 : (end - base - 1) >> levelshift[level];
+
+	for (int i = first; i <= last; ++i) {
+		// nothing mapped under this entry
+		if (src[i] == 0)
+			continue;
+
+		if (level == 3) {
+			uintptr_t physical = src[i] & ADDRMASK;
+			dst[i] = physical | flags;
+			src[i] &= ~ARCH_MMU_FLAGS_WRITE;
+			pmm_hold((void *)physical);
+			continue;
+		}
+
+		// huge pages are split so each page can be copied on write by itself
+		if (src[i] & LARGEPAGE) {
+			__assert(level == 2);
+			if (split(&src[i]) == false)
+				return false;
+		}
+
+		uint64_t *dstnext = next(dst[i]);
+		if (dstnext == NULL) {
+			dstnext = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
+			if (dstnext == NULL)
+				return false;
+			dst[i] = (uint64_t)dstnext | INTERMEDIATE_FLAGS;
+			dstnext = MAKE_HHDM(dstnext);
+		}
+
+		if (copytable(dstnext, next(src[i]), base + i * entrysize, start, end, level + 1, flags) == false)
+			return false;
+	}
+
+	return true;
+}
+
+// maps every page mapped in src in [start, end) to dst with flags, and write protects them in src, for copy on write.
+// the tlb is not invalidated, arch_mmu_invalidateall has to be called once everything was copied (even on failure)
+bool arch_mmu_cowcopy(pagetableptr_t dst, pagetableptr_t src, void *start, void *end, mmuflags_t flags) {
+	__assert(end <= USERSPACE_END);
+	return copytable(MAKE_HHDM(dst), MAKE_HHDM(src), 0, (uintptr_t)start, (uintptr_t)end, 0, flags);
+}
+
+typedef struct {
+	uint64_t ctxid[PCID_COUNT];
+	uint64_t tlbgen[PCID_COUNT];
+	int next;
+} pcidcpu_t;
+
+static bool pcidenabled;
+static pcidcpu_t pcidcpu[ARCH_MAX_CPUS];
+
+// called with interrupts disabled. if the context still has a pcid on this cpu and no shootdowns happened
+// for it since it was last loaded here, its tlb entries are still good and the switch doesn't flush them
+void arch_mmu_switch(struct vmmcontext_t *ctx) {
+	uint64_t cr3 = (uint64_t)ctx->pagetable;
+	if (pcidenabled) {
+		pcidcpu_t *state = &pcidcpu[_cpu()->number];
+		uint64_t tlbgen = __atomic_load_n(&ctx->tlbgen, __ATOMIC_SEQ_CST);
+		int pcid = 0;
+		for (int i = 0; i < PCID_COUNT; ++i) {
+			if (state->ctxid[i] == ctx->id) {
+				pcid = i + 1;
+				break;
+			}
+		}
+
+		if (pcid && state->tlbgen[pcid - 1] == tlbgen) {
+			cr3 |= pcid | CR3_NOFLUSH;
+		} else {
+			if (pcid == 0) {
+				pcid = state->next + 1;
+				state->next = (state->next + 1) % PCID_COUNT;
+				state->ctxid[pcid - 1] = ctx->id;
+			}
+
+			// loading cr3 without the no flush bit flushes the old entries of the pcid
+			state->tlbgen[pcid - 1] = tlbgen;
+			cr3 |= pcid;
+		}
+	}
+
+	asm volatile("mov %%rax, %%cr3" : : "a"(cr3) : "memory");
 }
 
 // hhdm pointer to template to be used for new mappings and smp bootup
@@ -197,36 +398,158 @@ pagetableptr_t arch_mmu_newtable() {
 	return table;
 }
 
-static void *mmupage = NULL;
+// a page count of FLUSH_ALL means the whole tlb
+#define FLUSH_ALL ((size_t)-1)
+
 static spinlock_t shootdownlock;
+static void **shootdownpages;
+static size_t shootdowncount;
 static int remaining = 0;
 
+static bool shootdownkernel;
+
+// flushes the non global entries of the current pcid
+static inline void flushtlb() {
+	asm volatile ("mov %%cr3, %%rax; mov %%rax, %%cr3" : : : "rax", "memory");
+}
+
+// toggling pge flushes everything, including global pages and other pcids
+static inline void flushglobal() {
+	asm volatile ("mov %%cr4, %%rax; xor %0, %%rax; mov %%rax, %%cr4; xor %0, %%rax; mov %%rax, %%cr4" : : "i"(CR4_PGE) : "rax", "memory");
+}
+
+static void invalidatelocal(void **pages, size_t count, bool kernel) {
+	if (count == FLUSH_ALL) {
+		if (kernel)
+			flushglobal();
+		else
+			flushtlb();
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i)
+		asm volatile ("invlpg (%%rax)" : : "a"(pages[i]) : "memory");
+}
+
 void arch_mmu_tlbipi(isr_t *isr, context_t *context) {
-	asm volatile ("invlpg (%%rax)" : : "a"(mmupage));
+	invalidatelocal(shootdownpages, shootdowncount, shootdownkernel);
 	__atomic_sub_fetch(&remaining, 1, __ATOMIC_SEQ_CST);
 }
 
-void arch_mmu_tlbshootdown(void *page) {
-	// scheduler not up yet, or there are no other cpus, nothing to do
+// invalidates the pages on the other cpus. kernel pages are shot down everywhere,
+// user pages only on the cpus that are running the address space ctx.
+// the cpus that aren't will flush the pcid of the address space when they switch back to it
+static void shootdown(void **pages, size_t count, bool kernel, struct vmmcontext_t *ctx) {
+	// a context that isn't the current one can have entries in a pcid of this cpu too
+	if (kernel == false && ctx != _cpu()->vmmctx)
+		__atomic_add_fetch(&ctx->tlbgen, 1, __ATOMIC_SEQ_CST);
+
+	// scheduler not up yet, or there are no other cpus, nothing else to do
 	if (_cpu()->thread == NULL || arch_smp_cpusawake == 1)
 		return;
 
-	if (page >= KERNELSPACE_START ||
-	(_cpu()->thread->proc->runningthreadcount > 1 && page >= USERSPACE_START && page < USERSPACE_END)) {
-		// shoot down if page is in the kernel space or in a multithreaded userland application
-		int oldipl = interrupt_raiseipl(IPL_DPC);
-		spinlock_acquire(&shootdownlock);
+	int oldipl = interrupt_raiseipl(IPL_DPC);
+	uint64_t targets = 0;
+	if (kernel == false) {
+		if (ctx == _cpu()->vmmctx)
+			__atomic_add_fetch(&ctx->tlbgen, 1, __ATOMIC_SEQ_CST);
+		targets = __atomic_load_n(&ctx->cpumask, __ATOMIC_SEQ_CST) & ~((uint64_t)1 << _cpu()->number);
+		if (targets == 0) {
+			interrupt_loweripl(oldipl);
+			return;
+		}
+	}
 
-		mmupage = page;
-		remaining = arch_smp_cpusawake - 1;
+	spinlock_acquire(&shootdownlock);
 
+	shootdownpages = pages;
+	shootdowncount = count;
+	shootdownkernel = kernel;
+
+	if (kernel) {
+		remaining = arch_smp_cpusawake - 1;
 		arch_smp_sendipi(NULL, &_cpu()->isr[0xfe], ARCH_SMP_IPI_OTHERCPUS, false);
+	} else {
+		remaining = __builtin_popcountll(targets);
+		for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+			if (targets & ((uint64_t)1 << i))
+				arch_smp_sendipi(arch_smp_cpus[i], &_cpu()->isr[0xfe], ARCH_SMP_IPI_TARGET, false);
+		}
+	}
+
+	while (__atomic_load_n(&remaining, __ATOMIC_SEQ_CST)) CPU_PAUSE();
+
+	spinlock_release(&shootdownlock);
+	interrupt_loweripl(oldipl);
+}
+
+void arch_mmu_tlbshootdown(void *page) {
+	if (page >= KERNELSPACE_START || (page >= USERSPACE_START && page < USERSPACE_END))
+		shootdown(&page, 1, page >= KERNELSPACE_START, _cpu()->vmmctx);
+}
+
+// flushes the user part of the tlb of the current address space
+void arch_mmu_invalidateall() {
+	int oldipl = interrupt_raiseipl(IPL_DPC);
+	invalidatelocal(NULL, FLUSH_ALL, false);
+	shootdown(NULL, FLUSH_ALL, false, _cpu()->vmmctx);
+	interrupt_loweripl(oldipl);
+}
+
+// page table changes done through a batch are invalidated all at once by arch_mmu_batchflush,
+// which also releases the physical pages that were queued with arch_mmu_batchrelease after that.
+// past ARCH_MMU_BATCH_PAGES pages the whole tlb is flushed instead
+
+void arch_mmu_batchinit(mmubatch_t *batch) {
+	batch->context = NULL;
+	batch->count = 0;
+	batch->kernel = false;
+	batch->releasecount = 0;
+}
+
+void arch_mmu_batchadd(mmubatch_t *batch, void *vaddr) {
+	if (vaddr >= KERNELSPACE_START)
+		batch->kernel = true;
+
+	if (batch->count < ARCH_MMU_BATCH_PAGES)
+		batch->pages[batch->count++] = vaddr;
+	else
+		batch->count = FLUSH_ALL;
+}
+
+void arch_mmu_batchrelease(mmubatch_t *batch, void *physical) {
+	if (batch->releasecount == ARCH_MMU_BATCH_RELEASE)
+		arch_mmu_batchflush(batch);
 
-		while (__atomic_load_n(&remaining, __ATOMIC_SEQ_CST)) CPU_PAUSE();
+	batch->release[batch->releasecount++] = physical;
+}
 
-		spinlock_release(&shootdownlock);
+void arch_mmu_batchflush(mmubatch_t *batch) {
+	if (batch->count) {
+		// stay on this cpu so it isn't left out of both the local flush and the shootdown
+		int oldipl = interrupt_raiseipl(IPL_DPC);
+		struct vmmcontext_t *ctx = batch->context ? batch->context : _cpu()->vmmctx;
+		// this cpu only has entries for another address space in its pcid, which the shootdown takes care of
+		if (batch->kernel || ctx == _cpu()->vmmctx)
+			invalidatelocal(batch->pages, batch->count, batch->kernel);
+		shootdown(batch->pages, batch->count, batch->kernel, ctx);
 		interrupt_loweripl(oldipl);
 	}
+
+	for (size_t i = 0; i < batch->releasecount; ++i)
+		pmm_release(batch->release[i]);
+
+	batch->count = 0;
+	batch->kernel = false;
+	batch->releasecount = 0;
+}
+
+void arch_mmu_unmapbatch(pagetableptr_t table, void *vaddr, mmubatch_t *batch) {
+	uint64_t *entry = get_page(table, vaddr);
+	if (entry == NULL)
+		return;
+	*entry = 0;
+	arch_mmu_batchadd(batch, vaddr);
 }
 
 extern void *_text_start;
@@ -301,33 +624,73 @@ static void gpfisr(isr_t *self, context_t *ctx) {
 	}
 }
 
+static size_t hhdmcount[3];
+
+// maps [base, top) in the hhdm using the biggest pages that fit. large pages never go past the range,
+// so holes in the memory map (like mmio) don't end up mapped as cacheable memory
+static void mapdirect(uintptr_t base, uintptr_t top, bool has1gb) {
+	uintptr_t address = ROUND_DOWN(base, PAGE_SIZE);
+	top = ROUND_UP(top, PAGE_SIZE);
+	while (address < top) {
+		uintptr_t size = PAGE_SIZE;
+		int depth = 0;
+		int count = 0;
+		if (has1gb && (address & (PAGE_SIZE_1GB - 1)) == 0 && address + PAGE_SIZE_1GB <= top) {
+			size = PAGE_SIZE_1GB;
+			depth = DEPTH_PD;
+			count = 2;
+		} else if ((address & (PAGE_SIZE_2MB - 1)) == 0 && address + PAGE_SIZE_2MB <= top) {
+			size = PAGE_SIZE_2MB;
+			depth = DEPTH_PT;
+			count = 1;
+		}
+
+		uint64_t entry = (address & ADDRMASK) | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC | GLOBALPAGE | (size == PAGE_SIZE ? 0 : LARGEPAGE);
+		__assert(add_page(FROM_HHDM(template), MAKE_HHDM((void *)address), entry, depth));
+		++hhdmcount[count];
+		address += size;
+	}
+}
+
 void arch_mmu_init() {
-	template = pmm_allocpage(PMM_SECTION_DEFAULT);
+	template = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 	__assert(template);
 	template = MAKE_HHDM(template);
-	memset(template, 0, PAGE_SIZE);
 
 	for (int i = 256; i < 512; ++i) {
-		uint64_t *entry = pmm_allocpage(PMM_SECTION_DEFAULT);
+		uint64_t *entry = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 		__assert(entry);
-		memset(MAKE_HHDM(entry), 0, PAGE_SIZE);
 		template[i] = (uint64_t)entry | INTERMEDIATE_FLAGS;
 	}
 
-	// TODO use 2mb pages
-	// populate hhdm
+	// populate hhdm. the memory map is sorted, so contiguous entries are merged to get more large pages
+
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+	bool has1gb = edx & CPUID_1GBPAGES;
+
+	uintptr_t rangebase = 0;
+	uintptr_t rangetop = 0;
+	for (size_t i = 0; i <= pmm_liminemap.response->entry_count; ++i) {
+		struct limine_memmap_entry *e = i < pmm_liminemap.response->entry_count ? pmm_liminemap.response->entries[i] : NULL;
+		if (e && e->type != LIMINE_MEMMAP_USABLE && e->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && e->type != LIMINE_MEMMAP_KERNEL_AND_MODULES && e->type != LIMINE_MEMMAP_FRAMEBUFFER)
+			continue;
 
-	for (size_t i = 0; i < pmm_liminemap.response->entry_count; ++i) {
-		struct limine_memmap_entry *e = pmm_liminemap.response->entries[i];
-		if (e->type != LIMINE_MEMMAP_USABLE && e->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && e->type != LIMINE_MEMMAP_KERNEL_AND_MODULES && e->type != LIMINE_MEMMAP_FRAMEBUFFER)
+		if (e && e->base == rangetop && rangetop != rangebase) {
+			rangetop = e->base + e->length;
 			continue;
+		}
+
+		mapdirect(rangebase, rangetop, has1gb);
 
-		for (uint64_t i = 0; i < e->length; i += PAGE_SIZE) {
-			uint64_t entry = ((e->base + i) & ADDRMASK) | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC;
-			__assert(add_page(FROM_HHDM(template), MAKE_HHDM((void *)(e->base + i)), entry, 0));
+		if (e) {
+			rangebase = e->base;
+			rangetop = e->base + e->length;
 		}
 	}
 
+	printf("mmu: hhdm mapped with %lu 1gb pages, %lu 2mb pages and %lu 4k pages\n", hhdmcount[2], hhdmcount[1], hhdmcount[0]);
+
 	__assert(kaddrreq.response);
 
 	// populate kernel
@@ -338,16 +701,25 @@ void arch_mmu_init() {
 		uintptr_t physicalbase = (uintptr_t)kerneladdr[i*2] - kaddrreq.response->virtual_base + kaddrreq.response->physical_base;
 
 		for (uintptr_t off = 0; off < len; off += PAGE_SIZE) {
-			uint64_t entry = ((physicalbase + off) & ADDRMASK) | kernelflags[i];
+			uint64_t entry = ((physicalbase + off) & ADDRMASK) | kernelflags[i] | GLOBALPAGE;
 			__assert(add_page(FROM_HHDM(template), (void *)(baseptr + off), entry, 0));
 		}
 	}
 
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	pcidenabled = ecx & CPUID_PCID;
+	printf("mmu: pcids %ssupported\n", pcidenabled ? "" : "not ");
+
 	arch_mmu_apswitch();
 }
 
 void arch_mmu_apswitch() {
-	arch_mmu_switch(FROM_HHDM(template));
+	// pcid 0 has to be loaded when enabling pcids
+	asm volatile("mov %%rax, %%cr3" : : "a"(FROM_HHDM(template)) : "memory");
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= CR4_PGE | (pcidenabled ? CR4_PCIDE : 0);
+	asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
 	interrupt_register(13, gpfisr, NULL, IPL_IGNORE);
 	interrupt_register(14, pfisr, NULL, IPL_IGNORE);
 	interrupt_register(0xfe, arch_mmu_tlbipi, ARCH_EOI, IPL_IGNORE);
@@ -14,6 +14,9 @@ static volatile struct limine_smp_request smprequest = {
 // set to 1 because of the bsp
 size_t arch_smp_cpusawake = 1;
 
+// indexed by cpu number
+cpu_t *arch_smp_cpus[ARCH_MAX_CPUS];
+
 // for panic. if the nosmp argument is given to the kernel, this is what the APs will jump to
 static void cpuwakeuphalt(struct limine_smp_info *info) {
 	asm("cli");
@@ -66,6 +69,15 @@ void arch_smp_wakeup() {
 	memset(apcpu, 0, apcpusize);
 
 	void (*wakeupfn)(struct limine_smp_info *) = cmdline_get("nosmp") ? cpuwakeuphalt : cpuwakeup;
+	size_t cpucount = response->cpu_count;
+	if (cpucount > ARCH_MAX_CPUS) {
+		printf("smp: only %d processors will be used\n", ARCH_MAX_CPUS);
+		cpucount = ARCH_MAX_CPUS;
+	}
+
+	// the bsp is always number 0
+	int number = 1;
+	arch_smp_cpus[0] = _cpu();
 
 	// make the other processors jump to cpuwakeup()
 	for (int i = 0; i < response->cpu_count; ++i) {
@@ -73,6 +85,14 @@ void arch_smp_wakeup() {
 		if (response->cpus[i]->lapic_id == response->bsp_lapic_id)
 			continue;
 
+		// park the processors that don't fit in the per-cpu arrays
+		if (number == cpucount) {
+			__atomic_store_n(&response->cpus[i]->goto_address, cpuwakeuphalt, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		apcpu[i].number = number;
+		arch_smp_cpus[number++] = &apcpu[i];
 		response->cpus[i]->extra_argument = (uint64_t)&apcpu[i];
 
 		__atomic_store_n(&response->cpus[i]->goto_address, wakeupfn, __ATOMIC_SEQ_CST);
@@ -80,7 +100,7 @@ void arch_smp_wakeup() {
 
 	// wait for other cpus to boot up
 	if (wakeupfn == cpuwakeup)
-		while (__atomic_load_n(&arch_smp_cpusawake, __ATOMIC_SEQ_CST) != response->cpu_count) asm("pause");
+		while (__atomic_load_n(&arch_smp_cpusawake, __ATOMIC_SEQ_CST) != cpucount) asm("pause");
 
 	printf("smp: awoke other processors\n");
 }
@@ -77,6 +77,8 @@ extern syscall_pause
 extern syscall_ppoll
 extern syscall_pread
 extern syscall_pwrite
+extern syscall_getpriority
+extern syscall_setpriority
 syscalltab:
 dq syscall_print
 dq syscall_mmap
@@ -156,7 +158,9 @@ dq syscall_pause
 dq syscall_ppoll
 dq syscall_pread
 dq syscall_pwrite
-syscallcount equ 78
+dq syscall_getpriority
+dq syscall_setpriority
+syscallcount equ 80
 section .text
 global arch_syscall_entry
 ; on entry:
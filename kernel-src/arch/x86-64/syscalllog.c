@@ -5,7 +5,7 @@
 
 #ifdef SYSCALL_LOGGING
 
-#define SYSCALL_COUNT 78
+#define SYSCALL_COUNT 80
 #define LOGSTR(x) arch_e9_puts(x)
 
 static char *name[] = {
@@ -86,7 +86,9 @@ static char *name[] = {
 	"pause",
 	"ppoll",
 	"pread",
-	"pwrite"
+	"pwrite",
+	"getpriority",
+	"setpriority"
 };
 
 static char *args[] = {
@@ -168,6 +170,8 @@ static char *args[] = {
 	"fds %p nfds %d timeout %p sigmask %p" // ppoll
 	"fd %d buffer %p count %lu offset %lu\n", // pread
 	"fd %d buffer %p count %lu offset %lu\n", // pwrite
+	"which %d who %d", // getpriority
+	"which %d who %d prio %d", // setpriority
 };
 
 #endif
@@ -21,7 +21,7 @@ static vfsops_t vfsops;
 static vops_t vnops;
 
 static int devfs_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *data) {
-	vfs_t *vfsp = alloc(sizeof(vfs_t));
+	vfs_t *vfsp = zalloc(sizeof(vfs_t));
 	if (vfs == NULL)
 		return ENOMEM;
 
@@ -351,11 +351,11 @@ static int devfs_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return error;
 }
 
-static int devfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int devfs_putpages(vnode_t *node, uintmax_t offset, void *buffer, size_t count) {
 	// only block devices will have this called
 	__assert(node->type == V_TYPE_BLKDEV);
 	size_t writec;
-	int error = VOP_WRITE(node, MAKE_HHDM(pmm_getpageaddress(page)), PAGE_SIZE, offset, 0, &writec, NULL);
+	int error = VOP_WRITE(node, buffer, count * PAGE_SIZE, offset, 0, &writec, NULL);
 	__assert(writec != 0);
 
 	return error;
@@ -398,7 +398,7 @@ static vops_t vnops = {
 	.maxseek = devfs_maxseek,
 	.resize = devfs_enodev,
 	.rename = devfs_enodev,
-	.putpage = devfs_putpage,
+	.putpages = devfs_putpages,
 	.getpage = devfs_getpage,
 	.sync = devfs_sync
 };
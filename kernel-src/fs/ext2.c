@@ -271,7 +271,7 @@ static int allocatestructure(ext2fs_t *fs, uintmax_t *retid, bool inode) {
 	}
 
 	size_t bmsize = (inode ? fs->superblock.inodespergroup : fs->superblock.blockspergroup) / 8;
-	bm = alloc(bmsize);
+	bm = zalloc(bmsize);
 	if (bm == NULL) {
 		e = ENOMEM;
 		goto cleanup;
@@ -360,7 +360,7 @@ static int freestructure(ext2fs_t *fs, uintmax_t id, bool inode) {
 		goto cleanup;
 
 	size_t bmsize = (inode ? fs->superblock.inodespergroup : fs->superblock.blockspergroup) / 8;
-	bm = alloc(bmsize);
+	bm = zalloc(bmsize);
 	if (bm == NULL) {
 		e = ENOMEM;
 		goto cleanup;
@@ -748,7 +748,8 @@ static int resizeinode(ext2fs_t *fs, ext2node_t *node, size_t newsize) {
 }
 
 static int rwblocks(ext2fs_t *fs, ext2node_t *node, void *buffer, size_t count, uintmax_t index, bool write, bool cache) {
-	for (uintmax_t i = 0; i < count; ++i) {
+	uintmax_t i = 0;
+	while (i < count) {
 		void *bufferp = (void *)((uintptr_t)buffer + i * fs->blocksize);
 		blockptr_t block;
 		int e = getinodeblock(fs, node, index + i, &block);
@@ -757,15 +758,30 @@ static int rwblocks(ext2fs_t *fs, ext2node_t *node, void *buffer, size_t count,
 
 		__assert(block);
 
+		// blocks that are next to each other on disk are done in a single request
+		size_t run = 1;
+		while (i + run < count) {
+			blockptr_t next;
+			e = getinodeblock(fs, node, index + i + run, &next);
+			if (e)
+				return e;
+
+			if (next != block + run)
+				break;
+
+			++run;
+		}
+
 		size_t donecount;
 		e = write ?
-			vfs_write(fs->backing, bufferp, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
-			vfs_read(fs->backing, bufferp, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
+			vfs_write(fs->backing, bufferp, run * fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
+			vfs_read(fs->backing, bufferp, run * fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
 
 		if (e)
 			return e;
 
-		__assert(donecount == fs->blocksize);
+		__assert(donecount == run * fs->blocksize);
+		i += run;
 	}
 	return 0;
 }
@@ -873,7 +889,7 @@ static int findindir(ext2fs_t *fs, ext2node_t *node, char *name, int *inode, ext
 static int insertdent(ext2fs_t *fs, ext2node_t *node, char *name, int inode, int type) {
 	size_t namelen = strlen(name);
 	size_t entlen = ROUND_UP(sizeof(ext2dent_t) + namelen, 4);
-	ext2dent_t *dentbuffer = alloc(entlen);
+	ext2dent_t *dentbuffer = zalloc(entlen);
 	if (dentbuffer == NULL)
 		return ENOMEM;
 
@@ -988,7 +1004,7 @@ static int removedent(ext2fs_t *fs, ext2node_t *node, char *name, int *inode) {
 
 // depth of 0 means singly, 1 means doubly and 2 means triply
 static int freeindirect(ext2fs_t *fs, uintmax_t block, int depth) {
-	blockptr_t *buffer = alloc(fs->blocksize);
+	blockptr_t *buffer = zalloc(fs->blocksize);
 	if (buffer == NULL)
 		return ENOMEM;
 
@@ -1239,7 +1255,7 @@ static int ext2_readlink(vnode_t *vnode, char **link, cred_t *cred) {
 	int err = 0;
 
 	size_t linksize = INODE_SIZE(&node->inode);
-	char *buf = alloc(linksize + 1);
+	char *buf = zalloc(linksize + 1);
 
 	// if the length of a symlink is larger than 60 bytes, its stored normally
 	// otherwise, its stored in the inode strucutre itself
@@ -1621,11 +1637,26 @@ static int ext2_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return error;
 }
 
-static int ext2_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int ext2_getpages(vnode_t *node, uintmax_t offset, void *buffer, size_t count, size_t *readcount) {
+	// only regular files get cached
+	__assert(node->type == V_TYPE_REGULAR);
+	size_t readc = 0;
+	int error = VOP_READ(node, buffer, count * PAGE_SIZE, offset, 0, &readc, NULL);
+	if (error)
+		return error;
+
+	// the last page can be cut at the end of the file
+	*readcount = ROUND_UP(readc, PAGE_SIZE) / PAGE_SIZE;
+	memset((void *)((uintptr_t)buffer + readc), 0, *readcount * PAGE_SIZE - readc);
+	return 0;
+}
+
+static int ext2_putpages(vnode_t *node, uintmax_t offset, void *buffer, size_t count) {
 	// only regular files get cached
 	__assert(node->type == V_TYPE_REGULAR);
+	// the write is cut at the end of the file, so a cluster ending at the last page doesn't grow it
 	size_t writec;
-	int error = VOP_WRITE(node, MAKE_HHDM(pmm_getpageaddress(page)), PAGE_SIZE, offset, 0, &writec, NULL);
+	int error = VOP_WRITE(node, buffer, count * PAGE_SIZE, offset, 0, &writec, NULL);
 	__assert(writec != 0);
 
 	return error;
@@ -1770,7 +1801,7 @@ static int ext2_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *
 	if (backing == NULL)
 		return EINVAL;
 
-	ext2fs_t *fs = alloc(sizeof(ext2fs_t));
+	ext2fs_t *fs = zalloc(sizeof(ext2fs_t));
 	if (fs == NULL)
 		return ENOMEM;
 
@@ -1882,7 +1913,8 @@ static vops_t vnops = {
 	.inactive = ext2_inactive,
 	.rename = ext2_rename,
 	.getpage = ext2_getpage,
-	.putpage = ext2_putpage,
+	.getpages = ext2_getpages,
+	.putpages = ext2_putpages,
 	.sync = ext2_sync
 };
 
@@ -177,7 +177,7 @@ int fd_clone(proc_t *targproc) {
 
 	targproc->fdcount = proc->fdcount;
 	targproc->fdfirst = proc->fdfirst;
-	targproc->fd = alloc(proc->fdcount * sizeof(fd_t));
+	targproc->fd = zalloc(proc->fdcount * sizeof(fd_t));
 	if (targproc->fd == NULL) {
 		error = ENOMEM;
 		goto cleanup;
@@ -322,7 +322,7 @@ static vops_t vnops = {
 	.getdents = pipefs_enodev,
 	.resize = pipefs_enodev,
 	.rename = pipefs_enodev,
-	.putpage = pipefs_enodev,
+	.putpages = pipefs_enodev,
 	.getpage = pipefs_enodev,
 	.sync = pipefs_enodev
 };
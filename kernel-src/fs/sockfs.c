@@ -130,7 +130,7 @@ int sockfs_ioctl(vnode_t *node, unsigned long request, void *arg, int *result) {
 			if (e)
 				return e;
 
-			char *dev = alloc(devlen + 1);
+			char *dev = zalloc(devlen + 1);
 			if (dev == NULL)
 				return ENOMEM;
 
@@ -199,7 +199,7 @@ static vops_t vnops = {
 	.resize = sockfs_enodev,
 	.rename = sockfs_enodev,
 	.ioctl = sockfs_ioctl,
-	.putpage = sockfs_enodev,
+	.putpages = sockfs_enodev,
 	.getpage = sockfs_enodev,
 	.sync = sockfs_enodev
 };
@@ -21,7 +21,7 @@ static vfsops_t vfsops;
 static uintmax_t currid = 1;
 
 static int tmpfs_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *data) {
-	tmpfs_t *tmpfs = alloc(sizeof(tmpfs_t));
+	tmpfs_t *tmpfs = zalloc(sizeof(tmpfs_t));
 	if (tmpfs == NULL)
 		return ENOMEM;
 
@@ -356,7 +356,7 @@ static int tmpfs_symlink(vnode_t *node, char *name, vattr_t *attr, char *path, c
 	if (node->type != V_TYPE_DIR)
 		return ENOTDIR;
 
-	char *pathbuf = alloc(strlen(path) + 1);
+	char *pathbuf = zalloc(strlen(path) + 1);
 	if (pathbuf == NULL)
 		return ENOMEM;
 
@@ -385,7 +385,7 @@ static int tmpfs_readlink(vnode_t *node, char **link, cred_t *cred) {
 	tmpfsnode_t *tmpnode = (tmpfsnode_t *)node;
 
 	VOP_LOCK(node);
-	char *ret = alloc(strlen(tmpnode->link) + 1);
+	char *ret = zalloc(strlen(tmpnode->link) + 1);
 	if (ret == NULL) {
 		VOP_UNLOCK(node);
 		return ENOMEM;
@@ -491,8 +491,8 @@ static int tmpfs_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return 0;
 }
 
-static int tmpfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
-	// putpage is a no-op on tmpfs
+static int tmpfs_putpages(vnode_t *node, uintmax_t offset, void *buffer, size_t count) {
+	// putpages is a no-op on tmpfs
 	return 0;
 }
 
@@ -528,7 +528,7 @@ static vops_t vnops = {
 	.resize = tmpfs_resize,
 	.rename = tmpfs_rename,
 	.getpage = tmpfs_getpage,
-	.putpage = tmpfs_putpage,
+	.putpages = tmpfs_putpages,
 	.sync = tmpfs_sync
 };
 
@@ -45,7 +45,7 @@ int vfs_pollstub(vnode_t *node, struct polldata *, int events) {
 
 void vfs_init() {
 	__assert(hashtable_init(&fstable, 20) == 0);
-	vfsroot = alloc(sizeof(vnode_t));
+	vfsroot = zalloc(sizeof(vnode_t));
 	__assert(vfsroot);
 	SPINLOCK_INIT(listlock);
 	vfsroot->type = V_TYPE_DIR;
@@ -125,7 +125,7 @@ int vfs_close(vnode_t *node, int flags) {
 // if node is not NULL, then a reference is kept and the newnode is returned in node
 int vfs_create(vnode_t *ref, char *path, vattr_t *attr, int type, vnode_t **node) {
 	vnode_t *parent;
-	char *component = alloc(strlen(path) + 1);
+	char *component = zalloc(strlen(path) + 1);
 	int err = vfs_lookup(&parent, ref, path, component, VFS_LOOKUP_PARENT);
 	if (err)
 		goto cleanup;
@@ -364,7 +364,7 @@ int vfs_read(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t
 // in both cases, linkref and linkpath describe the location of where to create the new link
 int vfs_link(vnode_t *destref, char *destpath, vnode_t *linkref, char *linkpath, int type, vattr_t *attr) {
 	__assert(type == V_TYPE_LINK || type == V_TYPE_REGULAR);
-	char *component = alloc(strlen(linkpath) + 1);
+	char *component = zalloc(strlen(linkpath) + 1);
 	vnode_t *parent = NULL;
 	int err = vfs_lookup(&parent, linkref, linkpath, component, VFS_LOOKUP_PARENT);
 	if (err)
@@ -391,7 +391,7 @@ int vfs_link(vnode_t *destref, char *destpath, vnode_t *linkref, char *linkpath,
 }
 
 int vfs_unlink(vnode_t *ref, char *path) {
-	char *component = alloc(strlen(path) + 1);
+	char *component = zalloc(strlen(path) + 1);
 	vnode_t *parent = NULL;
 	int err = vfs_lookup(&parent, ref, path, component, VFS_LOOKUP_PARENT);
 	if (err)
@@ -458,7 +458,7 @@ int vfs_lookup(vnode_t **result, vnode_t *start, char *path, char *lastcomp, int
 	if (error)
 		return error;
 
-	char *compbuffer = alloc(pathlen + 1);
+	char *compbuffer = zalloc(pathlen + 1);
 	if (compbuffer == NULL)
 		return ENOMEM;
 
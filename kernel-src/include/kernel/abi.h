@@ -26,6 +26,10 @@ typedef uint64_t blkcnt_t;
 #define POLLWRNORM 0x100
 #define POLLRDHUP 0x2000
 
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
 typedef struct {
 	dev_t dev;
 	ino_t ino;
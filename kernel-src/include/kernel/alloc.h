@@ -5,6 +5,7 @@
 
 void alloc_init();
 void *alloc(size_t s);
+void *zalloc(size_t s);
 void *realloc(void *addr, size_t s);
 void free(void *addr);
 
@@ -18,6 +18,7 @@
 #define DEV_MAJOR_NET 10
 #define DEV_MAJOR_MOUSE 11
 #define DEV_MAJOR_PTY 12
+#define DEV_MAJOR_SLABINFO 13
 
 typedef struct {
 	int (*open)(int minor, vnode_t **vnode, int flags);
@@ -40,6 +41,8 @@ typedef struct devnode_t {
 	vnode_t *physical;
 	struct devnode_t *master;
 	hashtable_t children;
+	// for block devices
+	vwriteback_t writeback;
 } devnode_t;
 
 void devfs_init();
@@ -3,38 +3,44 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define PMM_SECTION_COUNT 3
 #define PMM_SECTION_1MB 0
 #define PMM_SECTION_4GB 1
 #define PMM_SECTION_DEFAULT 2
+#define PMM_SECTION_MASK 0xff
 
+// can be or'd with the section passed to pmm_allocpage or pmm_alloc to get zero filled memory
+#define PMM_FLAGS_ZERO 0x100
+// can be or'd with the section passed to pmm_allocpage or pmm_alloc to fail right away instead of reclaiming memory
+#define PMM_FLAGS_NORECLAIM 0x200
+
+// largest buddy block is 2^PMM_MAX_ORDER pages
+#define PMM_MAX_ORDER 10
+#define PMM_ORDER_COUNT (PMM_MAX_ORDER + 1)
+
+// set only on the first page of a free buddy block
 #define PAGE_FLAGS_FREE 1
 #define PAGE_FLAGS_TRUNCATED 2
 #define PAGE_FLAGS_PINNED 4
 #define PAGE_FLAGS_DIRTY 8
 #define PAGE_FLAGS_READY 16
 #define PAGE_FLAGS_ERROR 32
+// page cache replacement state, see pmm_markaccessed
+#define PAGE_FLAGS_REFERENCED 64
+#define PAGE_FLAGS_ACTIVE 128
 
 typedef struct page_t {
 	struct vnode_t *backing;
 	uintmax_t offset;
-	struct page_t *hashnext;
-	struct page_t *hashprev;
-	struct page_t *vnodenext;
-	struct page_t *vnodeprev;
-	union {
-		struct {
-			struct page_t *freenext;
-			struct page_t *freeprev;
-		};
-		struct {
-			struct page_t *writenext;
-			struct page_t *writeprev;
-		};
-	};
+	// object pages of indirect slabs
+	struct slab_t *slab;
+	struct page_t *freenext;
+	struct page_t *freeprev;
 	uintmax_t refcount;
 	int flags;
+	int order;
 } page_t;
 
 void *pmm_allocpage(int section);
@@ -45,6 +51,11 @@ void pmm_release(void *addr);
 void pmm_makefree(void *address, size_t count);
 void *pmm_alloc(size_t size, int section);
 void pmm_free(void *addr, size_t size);
+size_t pmm_reclaimstandby(size_t count);
+size_t pmm_standbycount();
+size_t pmm_totalpages();
+void pmm_markaccessed(page_t *page);
+bool pmm_zeroidle();
 void pmm_init();
 
 extern uintptr_t hhdmbase;
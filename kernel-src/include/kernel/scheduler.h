@@ -20,6 +20,9 @@
 #define SCHED_PROC_STATE_NORMAL 0
 #define SCHED_PROC_STATE_ZOMBIE 1
 
+#define SCHED_NICE_MIN -20
+#define SCHED_NICE_MAX 19
+
 #define SCHED_WAKEUP_REASON_NORMAL 0
 #define SCHED_WAKEUP_REASON_INTERRUPTED -1
 
@@ -46,6 +49,13 @@ typedef struct thread_t {
 	tid_t tid;
 	int flags;
 	long priority;
+	// fair scheduling of user threads. the virtual runtime is relative to the run queue of vruntimecpu
+	uintmax_t vruntime;
+	struct cpu_t *vruntimecpu;
+	unsigned long weight;
+	time_t runstart;
+	struct thread_t *heapchild;
+	struct thread_t *heapsibling;
 	bool sleepintstatus;
 	spinlock_t sleeplock;
 	int wakeupreason;
@@ -81,6 +91,7 @@ typedef struct proc_t {
 	mutex_t fdmutex;
 	struct fd_t *fd;
 	mode_t umask;
+	int nice;
 	int flags;
 	vnode_t *cwd;
 	vnode_t *root;
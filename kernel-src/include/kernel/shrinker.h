@@ -0,0 +1,20 @@
+#ifndef _SHRINKER_H
+#define _SHRINKER_H
+
+#include <stddef.h>
+
+// subsystems holding on to memory that can be given back register a shrinker.
+// count returns roughly how many pages scan could free right now,
+// scan tries to free up to count pages and returns how many it did
+typedef struct shrinker_t {
+	struct shrinker_t *next;
+	size_t (*count)(struct shrinker_t *shrinker);
+	size_t (*scan)(struct shrinker_t *shrinker, size_t count);
+} shrinker_t;
+
+void shrinker_register(shrinker_t *shrinker);
+void shrinker_unregister(shrinker_t *shrinker);
+size_t shrinker_run(size_t target);
+void shrinker_init();
+
+#endif
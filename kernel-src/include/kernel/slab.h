@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <mutex.h>
+#include <spinlock.h>
 
 typedef struct slab_t {
 	struct slab_t *next;
@@ -13,22 +14,62 @@ typedef struct slab_t {
 	void *base;
 } slab_t;
 
+typedef struct slabmagazine_t {
+	struct slabmagazine_t *next;
+	size_t rounds;
+	void *objects[];
+} slabmagazine_t;
+
+// per-cpu front end of a cache. only touched by its own cpu with interrupts disabled,
+// the lock is there so the magazines can be flushed from other cpus.
+typedef struct {
+	spinlock_t lock;
+	slabmagazine_t *loaded;
+	slabmagazine_t *previous;
+	size_t hits;
+	size_t misses;
+} __attribute__((aligned(64))) slabcpu_t;
+
 typedef struct scache_t {
+	struct scache_t *next;
+	struct scache_t *prev;
 	mutex_t mutex;
 	void (*ctor)(struct scache_t *cache, void *obj);
 	void (*dtor)(struct scache_t *cache, void *obj);
 	slab_t *full;
 	slab_t *partial;
 	slab_t *empty;
+	size_t emptycount;
 	size_t size;
 	size_t truesize;
 	size_t alignment;
 	size_t slabobjcount;
+	// magazine layer, cpu is NULL for caches without one
+	slabcpu_t *cpu;
+	size_t magsize;
+	spinlock_t depotlock;
+	slabmagazine_t *depotfull;
+	slabmagazine_t *depotempty;
+	size_t depotfullcount;
+	size_t depotemptycount;
+	size_t depothits;
+	size_t depotmisses;
 } scache_t;
 
+typedef struct {
+	size_t cpuhits;
+	size_t cpumisses;
+	size_t depothits;
+	size_t depotmisses;
+	size_t depotfull;
+	size_t depotempty;
+} slabstats_t;
+
 void *slab_allocate(scache_t *cache);
 void slab_free(scache_t *cache, void *addr);
 scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *, void *), void (*dtor)(scache_t *, void *));
 void slab_freecache(scache_t *cache);
+void slab_getstats(scache_t *cache, slabstats_t *stats);
+size_t slab_printstats(char *buffer, size_t size);
 
 #endif
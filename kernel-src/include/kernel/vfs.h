@@ -8,6 +8,7 @@
 #include <kernel/abi.h>
 #include <time.h>
 #include <errno.h>
+#include <radix.h>
 
 typedef struct {
 	uid_t uid;
@@ -43,12 +44,20 @@ typedef struct {
 	size_t blocksused;
 } vattr_t;
 
+// page cache writeback state of a device, pages that are dirty or being written and the rate in
+// pages per second they have been written at
+typedef struct {
+	size_t dirtypages;
+	size_t rate;
+} vwriteback_t;
+
 typedef struct vfs_t {
 	struct vfs_t *next;
 	struct vfsops_t *ops;
 	struct vnode_t *nodecovered;
 	struct vnode_t *root;
 	int flags;
+	vwriteback_t writeback;
 } vfs_t;
 
 #define V_FLAGS_ROOT 1
@@ -69,6 +78,8 @@ typedef struct vfs_t {
 #define V_FFLAGS_NOCTTY 32
 #define V_FFLAGS_NOCACHE 64
 
+struct vmmrange_t;
+
 typedef struct vnode_t {
 	struct vops_t *ops;
 	mutex_t lock;
@@ -79,7 +90,23 @@ typedef struct vnode_t {
 	vfs_t *vfs;
 	vfs_t *vfsmounted;
 	void *socketbinding;
-	struct page_t *pages;
+	// page cache pages of the vnode indexed by page number, with the dirty and writeback tags
+	radix_t pages;
+	mutex_t pageslock;
+	// readahead state, protected by pageslock
+	uintmax_t ranext;
+	uintmax_t raend;
+	size_t rawindow;
+	// list of vnodes with dirty pages in the order they were first dirtied, protected by the page cache lock
+	struct vnode_t *dirtynext;
+	struct vnode_t *dirtyprev;
+	size_t dirtycount;
+	// address space ranges mapping the page cache pages of the vnode, and the list of vnodes that have any.
+	// see vmm.c
+	struct vmmrange_t *mappings;
+	mutex_t mappingslock;
+	struct vnode_t *mappednext;
+	struct vnode_t *mappedprev;
 } vnode_t;
 
 typedef struct vfsops_t {
@@ -90,6 +117,7 @@ typedef struct vfsops_t {
 } vfsops_t;
 
 struct polldata;
+struct page_t;
 
 typedef struct vops_t {
 	int (*open)(vnode_t **node, int flags, cred_t *cred);
@@ -116,7 +144,9 @@ typedef struct vops_t {
 	int (*resize)(vnode_t *node, size_t newsize, cred_t *cred);
 	int (*rename)(vnode_t *source, char *oldname, vnode_t *target, char *newname, int flags);
 	int (*getpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
-	int (*putpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
+	// optional, fills count contiguous pages in buffer at once. readcount is set to the number of pages with file data
+	int (*getpages)(vnode_t *node, uintmax_t offset, void *buffer, size_t count, size_t *readcount);
+	int (*putpages)(vnode_t *node, uintmax_t offset, void *buffer, size_t count);
 	int (*sync)(vnode_t *node);
 } vops_t;
 
@@ -140,7 +170,19 @@ typedef struct vops_t {
 	(vn)->flags = f; \
 	(vn)->type = t; \
 	(vn)->vfs = v; \
-	(vn)->vfsmounted = NULL; 
+	(vn)->vfsmounted = NULL; \
+	RADIX_INIT(&(vn)->pages); \
+	MUTEX_INIT(&(vn)->pageslock); \
+	(vn)->ranext = 0; \
+	(vn)->raend = 0; \
+	(vn)->rawindow = 0; \
+	(vn)->dirtynext = NULL; \
+	(vn)->dirtyprev = NULL; \
+	(vn)->dirtycount = 0; \
+	(vn)->mappings = NULL; \
+	MUTEX_INIT(&(vn)->mappingslock); \
+	(vn)->mappednext = NULL; \
+	(vn)->mappedprev = NULL;
 
 #define VOP_LOCK(v) MUTEX_ACQUIRE(&(v)->lock, false)
 #define VOP_UNLOCK(v) MUTEX_RELEASE(&(v)->lock)
@@ -168,7 +210,8 @@ typedef struct vops_t {
 #define VOP_RESIZE(v, s, c) (v)->ops->resize(v, s, c)
 #define VOP_RENAME(s, o, t, n, f) (s)->ops->rename(s, o, t, n, f)
 #define VOP_GETPAGE(v, o, p) (v)->ops->getpage(v, o, p)
-#define VOP_PUTPAGE(v, o, p) (v)->ops->putpage(v, o, p)
+#define VOP_GETPAGES(v, o, b, c, rc) (v)->ops->getpages(v, o, b, c, rc)
+#define VOP_PUTPAGES(v, o, b, c) (v)->ops->putpages(v, o, b, c)
 #define VOP_SYNC(v) (v)->ops->sync(v)
 #define VOP_HOLD(v) __atomic_add_fetch(&(v)->refcount, 1, __ATOMIC_SEQ_CST)
 #define VOP_RELEASE(v) {\
@@ -12,6 +12,8 @@
 #define VMM_FLAGS_EXACT   16
 #define VMM_FLAGS_SHARED  32
 #define VMM_FLAGS_REPLACE 64
+// vmm_unmap only, the caller already holds the locks of the space
+#define VMM_FLAGS_LOCKED 128
 
 #define VMM_PERMANENT_FLAGS_MASK (VMM_FLAGS_FILE | VMM_FLAGS_SHARED | VMM_FLAGS_PHYSICAL)
 
@@ -25,9 +27,17 @@ typedef struct {
 } vmmfiledesc_t;
 
 struct vmmcache_t;
+struct vmmspace_t;
 typedef struct vmmrange_t{
 	struct vmmrange_t *next;
 	struct vmmrange_t *prev;
+	// tree links, the gap is the free space between the previous range and this one
+	struct vmmrange_t *parent;
+	struct vmmrange_t *left;
+	struct vmmrange_t *right;
+	size_t gap;
+	size_t maxgap;
+	bool red;
 	void *start;
 	size_t size;
 	int flags;
@@ -38,6 +48,11 @@ typedef struct vmmrange_t{
 			size_t offset;
 		};
 	};
+	// ranges mapping cacheable vnodes are in the mappings list of the vnode, for finding their pages
+	// from the vnode side. protected by the mappingslock of the vnode
+	struct vmmrange_t *vnodenext;
+	struct vmmrange_t *vnodeprev;
+	struct vmmspace_t *space;
 } vmmrange_t;
 
 typedef struct {
@@ -54,16 +69,24 @@ typedef struct vmmcache_t {
 	vmmrange_t ranges[VMM_RANGES_PER_CACHE];
 } vmmcache_t;
 
-typedef struct {
+typedef struct vmmspace_t {
 	mutex_t lock;
+	mutex_t pflock;
 	vmmrange_t *ranges;
+	vmmrange_t *root;
 	void *start;
 	void *end;
 } vmmspace_t;
 
-typedef struct {
+typedef struct vmmcontext_t {
 	vmmspace_t space;
 	pagetableptr_t pagetable;
+	// cpus that currently have the page table loaded, for tlb shootdowns
+	uint64_t cpumask;
+	// unique for every context, used to find the pcid of the context on a cpu
+	uint64_t id;
+	// bumped on every user shootdown, cpus that switch back with an older generation flush the pcid
+	uint64_t tlbgen;
 } vmmcontext_t;
 
 extern vmmcontext_t vmm_kernelctx;
@@ -95,11 +118,15 @@ static inline int mmuflagstovnodeflags(mmuflags_t mmuflags) {
 void vmm_destroycontext(vmmcontext_t *context);
 vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext);
 void *vmm_map(void *addr, size_t size, int flags, mmuflags_t mmuflags, void *private);
-void vmm_unmap(void *addr, size_t size, int flags);
+int vmm_unmap(void *addr, size_t size, int flags);
+bool vmm_trylockkernel();
+void vmm_unlockkernel();
 bool vmm_pagefault(void *addr, bool user, int actions);
 vmmcontext_t *vmm_newcontext();
 void vmm_switchcontext(vmmcontext_t *ctx);
 void *vmm_getphysical(void *addr);
+size_t vmm_unmapcold(size_t count);
+void vmm_unmapvnode(vnode_t *vnode, uintmax_t offset);
 void vmm_apinit();
 void vmm_init();
 
@@ -8,6 +8,7 @@ extern size_t vmmcache_cachedpages;
 
 void vmmcache_init();
 int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res);
+int vmmcache_getresident(vnode_t *vnode, uintmax_t offset, page_t **res);
 int vmmcache_takepage(page_t *page);
 int vmmcache_makedirty(page_t *page);
 int vmmcache_truncate(vnode_t *vnode, uintmax_t offset);
@@ -15,5 +16,6 @@ int vmmcache_syncvnode(vnode_t *vnode, uintmax_t startoffset, size_t size);
 int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page);
 int vmmcache_sync();
 int vmmcache_evict(page_t *page);
+void vmmcache_throttle(vnode_t *vnode, size_t size);
 
 #endif
@@ -0,0 +1,45 @@
+#ifndef _RADIX_H
+#define _RADIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define RADIX_SHIFT 6
+#define RADIX_SLOTS (1 << RADIX_SHIFT)
+#define RADIX_TAG_COUNT 2
+#define RADIX_TAG_NONE -1
+
+// a bit in used is set for every slot that is in use. the tags of leaves are set for the tagged items,
+// the tags of the nodes above them are set if anything under the slot is tagged
+typedef struct radixnode_t {
+	struct radixnode_t *parent;
+	int offset;
+	int shift;
+	uint64_t used;
+	uint64_t tags[RADIX_TAG_COUNT];
+	void *slots[RADIX_SLOTS];
+} radixnode_t;
+
+typedef struct {
+	radixnode_t *root;
+} radix_t;
+
+#define RADIX_INIT(r) (r)->root = NULL;
+
+// nothing here allocates or frees memory, so the trees can be used with locks that memory reclaim needs.
+// insertions take the nodes they need from a spare list (given by radix_allocnodes) and removals put
+// the nodes that went unused in a list, both to be freed with radix_freenodes after the lock is released
+
+radixnode_t *radix_allocnodes(size_t count);
+void radix_freenodes(radixnode_t *list);
+size_t radix_nodesneeded(radix_t *tree, uintmax_t index);
+void radix_insert(radix_t *tree, uintmax_t index, void *item, radixnode_t **spare);
+void *radix_remove(radix_t *tree, uintmax_t index, radixnode_t **freed);
+void *radix_lookup(radix_t *tree, uintmax_t index);
+void *radix_next(radix_t *tree, uintmax_t *index, int tag);
+void radix_settag(radix_t *tree, uintmax_t index, int tag);
+void radix_cleartag(radix_t *tree, uintmax_t index, int tag);
+bool radix_gettag(radix_t *tree, uintmax_t index, int tag);
+
+#endif
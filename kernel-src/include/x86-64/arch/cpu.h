@@ -15,11 +15,15 @@
 
 #define ARCH_EOI arch_apic_eoi
 
+// upper bound for per-cpu arrays. cpu_t->number is always below this
+#define ARCH_MAX_CPUS 64
+
 typedef struct cpu_t {
 	thread_t *thread;
 	uint64_t gdt[7];
 	ist_t ist;
 	long id;
+	int number;
 	isr_t isr[MAX_ISR_COUNT];
 	vmmcontext_t *vmmctx;
 	int acpiid;
@@ -13,6 +13,7 @@
 #define IS_USER_ADDRESS(a) ((void *)a < USERSPACE_END)
 
 #define PAGE_SIZE 4096
+#define ARCH_MMU_HUGEPAGE_SIZE ((size_t)1 << 21)
 #define ARCH_MMU_FLAGS_READ (uint64_t)1
 #define ARCH_MMU_FLAGS_WRITE (uint64_t)2
 #define ARCH_MMU_FLAGS_USER (uint64_t)4
@@ -22,19 +23,47 @@
 #define ARCH_MMU_FLAGS_WT (1 << 3)
 #define ARCH_MMU_FLAGS_UC (1 << 4)
 
+struct vmmcontext_t;
+
 typedef uint64_t mmuflags_t;
 typedef uint64_t * pagetableptr_t; // physical address
 
+#define ARCH_MMU_BATCH_PAGES 32
+#define ARCH_MMU_BATCH_RELEASE 128
+
+// the user pages of a batch are in context, or in the current address space if it is NULL
+typedef struct {
+	struct vmmcontext_t *context;
+	size_t count;
+	bool kernel;
+	void *pages[ARCH_MMU_BATCH_PAGES];
+	size_t releasecount;
+	void *release[ARCH_MMU_BATCH_RELEASE];
+} mmubatch_t;
+
 void arch_mmu_destroytable(pagetableptr_t table);
 bool arch_mmu_map(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
 void arch_mmu_invalidate(void *vaddr);
 void arch_mmu_unmap(pagetableptr_t table, void *vaddr);
 void arch_mmu_remap(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
-void arch_mmu_switch(pagetableptr_t table);
+void arch_mmu_switch(struct vmmcontext_t *ctx);
 void *arch_mmu_getphysical(pagetableptr_t table, void *vaddr);
 bool arch_mmu_ispresent(pagetableptr_t table, void *vaddr);
 bool arch_mmu_iswritable(pagetableptr_t table, void *vaddr);
 bool arch_mmu_isdirty(pagetableptr_t table, void *vaddr);
+bool arch_mmu_isaccessed(pagetableptr_t table, void *vaddr);
+bool arch_mmu_clearaccessed(pagetableptr_t table, void *vaddr);
+bool arch_mmu_maphuge(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
+bool arch_mmu_canmaphuge(pagetableptr_t table, void *vaddr);
+bool arch_mmu_ishuge(pagetableptr_t table, void *vaddr);
+bool arch_mmu_splithuge(pagetableptr_t table, void *vaddr);
+bool arch_mmu_cowcopy(pagetableptr_t dst, pagetableptr_t src, void *start, void *end, mmuflags_t flags);
+void arch_mmu_invalidateall();
+void arch_mmu_batchinit(mmubatch_t *batch);
+void arch_mmu_batchadd(mmubatch_t *batch, void *vaddr);
+void arch_mmu_batchrelease(mmubatch_t *batch, void *physical);
+void arch_mmu_batchflush(mmubatch_t *batch);
+void arch_mmu_unmapbatch(pagetableptr_t table, void *vaddr, mmubatch_t *batch);
 pagetableptr_t arch_mmu_newtable();
 void arch_mmu_init();
 void arch_mmu_apswitch();
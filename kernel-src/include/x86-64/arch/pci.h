@@ -84,7 +84,7 @@ static void pci_archinit() {
 		pci_archread32 = mcfg_read32;
 		pci_archwrite32 = mcfg_write32;
 		mcfgentrycount = (mcfg->header.length - sizeof(sdtheader_t)) / sizeof(mcfgentry_t);
-		mcfgentries = alloc(sizeof(mcfgentry_t) * mcfgentrycount);
+		mcfgentries = zalloc(sizeof(mcfgentry_t) * mcfgentrycount);
 		__assert(mcfgentries);
 		memcpy(mcfgentries, mcfg->entries, sizeof(mcfgentry_t) * mcfgentrycount);
 		for (int i = 0; i < mcfgentrycount; ++i) {
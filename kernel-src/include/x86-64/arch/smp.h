@@ -6,7 +6,11 @@
 #define ARCH_SMP_IPI_ALL 2
 #define ARCH_SMP_IPI_OTHERCPUS 3
 
+// fixed on every cpu so it can be sent from any of them
+#define ARCH_SMP_RESCHED_VECTOR 0xfc
+
 extern size_t arch_smp_cpusawake;
+extern cpu_t *arch_smp_cpus[];
 
 void arch_smp_wakeup();
 void arch_smp_sendipi(cpu_t *targcpu, isr_t *isr, int target, bool nmi);
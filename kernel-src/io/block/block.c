@@ -103,7 +103,11 @@ static int rwblock(int minor, void *buffer, size_t size, uintmax_t offset, int f
 	if (lbabuffer == NULL)
 		return ENOMEM;
 
-	int error = DISK_READ(desc, lbabuffer, lbaoffset + desc->lbaoffset, lbacount);
+	// writes that cover whole blocks don't need the old data, the rest read it first to keep the bytes around them
+	int error = 0;
+	if (write == false || startoffset || (size % desc->blocksize))
+		error = DISK_READ(desc, lbabuffer, lbaoffset + desc->lbaoffset, lbacount);
+
 	if (error)
 		goto cleanup;
 
@@ -226,7 +230,7 @@ static void dogpt(blockdesc_t *desc, char *name) {
 
 		snprintf(partname, namebuflen, "%sp%d", name, partid++);
 
-		blockdesc_t *partdesc = alloc(sizeof(blockdesc_t));
+		blockdesc_t *partdesc = zalloc(sizeof(blockdesc_t));
 		__assert(partdesc);
 
 		*partdesc = *desc;
@@ -259,7 +263,7 @@ static void dombr(blockdesc_t *desc, char *name) {
 
 		snprintf(partname, namebuflen, "%sp%d", name, partid++);
 
-		blockdesc_t *partdesc = alloc(sizeof(blockdesc_t));
+		blockdesc_t *partdesc = zalloc(sizeof(blockdesc_t));
 		__assert(partdesc);
 
 		*partdesc = *desc;
@@ -274,7 +278,7 @@ static void dombr(blockdesc_t *desc, char *name) {
 }
 
 void block_register(blockdesc_t *desc, char *name) {
-	blockdesc_t *permdesc = alloc(sizeof(blockdesc_t));
+	blockdesc_t *permdesc = zalloc(sizeof(blockdesc_t));
 	__assert(permdesc);
 	*permdesc = *desc;
 
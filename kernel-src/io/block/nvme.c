@@ -543,11 +543,11 @@ static int write(void *private, void *buffer, uintmax_t lba, size_t count) {
 }
 
 static void initnamespace(nvmecontroller_t *controller, int id) {
-	namespaceid_t *namespaceid = alloc(IDENTIFY_SIZE);
+	namespaceid_t *namespaceid = zalloc(IDENTIFY_SIZE);
 	__assert(namespaceid);
 	__assert(IDENTIFY_NAMESPACE(controller, namespaceid, id) == 0);
 
-	nvmenamespace_t *namespace = alloc(sizeof(nvmenamespace_t));
+	nvmenamespace_t *namespace = zalloc(sizeof(nvmenamespace_t));
 	__assert(namespace);
 
 	namespace->controller = controller;
@@ -669,7 +669,7 @@ static void initcontroller(pcienum_t *e) {
 		return;
 	}
 
-	nvmecontroller_t *controller = alloc(sizeof(nvmecontroller_t));
+	nvmecontroller_t *controller = zalloc(sizeof(nvmecontroller_t));
 	__assert(controller);
 
 	controller->id = ctlrid;
@@ -697,7 +697,7 @@ static void initcontroller(pcienum_t *e) {
 	}
 
 	// identify controller
-	controllerid_t *controllerid = alloc(IDENTIFY_SIZE);
+	controllerid_t *controllerid = zalloc(IDENTIFY_SIZE);
 	__assert(controllerid);
 	__assert(IDENTIFY_CONTROLLER(controller, controllerid) == 0);
 
@@ -731,7 +731,7 @@ static void initcontroller(pcienum_t *e) {
 	bar0->cc = cc;
 
 	// get namespace list
-	uint32_t *namespacelist = alloc(IDENTIFY_SIZE);
+	uint32_t *namespacelist = zalloc(IDENTIFY_SIZE);
 	__assert(namespacelist);
 	__assert(IDENTIFY_NAMESPACELIST(controller, namespacelist) == 0);
 
@@ -744,7 +744,7 @@ static void initcontroller(pcienum_t *e) {
 	controller->paircount = iocount;
 
 	// create i/o queues
-	controller->ioqueues = alloc(sizeof(queuepair_t) * iocount);
+	controller->ioqueues = zalloc(sizeof(queuepair_t) * iocount);
 	__assert(controller->ioqueues);
 
 	for (int i = 0; i < iocount; ++i) {
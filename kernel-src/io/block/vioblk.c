@@ -162,7 +162,7 @@ int vioblk_newdevice(viodevice_t *viodevice) {
 	__assert(virtio_negotiatefeatures(viodevice, VIO_FEATURE_VERSION_1) == VIO_FEATURE_VERSION_1);
 
 	// initialize device object
-	vioblkdev_t *blkdev = alloc(sizeof(vioblkdev_t));
+	vioblkdev_t *blkdev = zalloc(sizeof(vioblkdev_t));
 	__assert(blkdev);
 
 	static int id = 0;
@@ -207,8 +207,8 @@ void fb_init() {
 	count = fb_liminereq.response->framebuffer_count;
 	printf("fb: %d framebuffer device%c\n", count, count > 1 ? 's' : ' ');
 
-	fixinfos = alloc(count * sizeof(fixinfo_t));
-	varinfos = alloc(count * sizeof(varinfo_t));
+	fixinfos = zalloc(count * sizeof(fixinfo_t));
+	varinfos = zalloc(count * sizeof(varinfo_t));
 	__assert(fixinfos && varinfos);
 
 	for (int i = 0; i < count; ++i) {
@@ -21,7 +21,7 @@ static int currentkbnum;
 keyboard_t *keyboard_console;
 
 static keyboard_t *newkb() {
-	keyboard_t *kb = alloc(sizeof(keyboard_t));
+	keyboard_t *kb = zalloc(sizeof(keyboard_t));
 	if (kb == NULL)
 		return NULL;
 
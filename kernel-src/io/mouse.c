@@ -12,7 +12,7 @@
 static int currentnum;
 
 static mouse_t *newmouse() {
-	mouse_t *mouse = alloc(sizeof(mouse_t));
+	mouse_t *mouse = zalloc(sizeof(mouse_t));
 	if (mouse == NULL)
 		return NULL;
 
@@ -225,7 +225,7 @@ int ipv4_sendpacket(void *buffer, size_t packetsize, uint32_t ip, int proto, net
 void ipv4_init() {
 	routingtablesize = 1;
 	MUTEX_INIT(&routingtablelock);
-	routingtable = alloc(sizeof(routingentry_t));
+	routingtable = zalloc(sizeof(routingentry_t));
 	__assert(routingtable);
 	__assert(ipv4_addroute(loopback_device(), 0x7f000001, 0, 0xff000000, 10000) == 0);
 }
@@ -479,7 +479,7 @@ static int localsock_connect(socket_t *socket, sockaddr_t *addr, uintmax_t flags
 		VOP_RELEASE(binding->vnode);
 	}
 
-	localpair_t *pair = alloc(sizeof(localpair_t));
+	localpair_t *pair = zalloc(sizeof(localpair_t));
 	if (pair == NULL) {
 		error = ENOMEM;
 		goto leave;
@@ -562,7 +562,7 @@ static int localsock_listen(socket_t *socket, int backlogsize) {
 
 	MUTEX_ACQUIRE(&localsocket->binding->mutex, false);
 
-	localsocket->backlog = alloc(backlogsize * sizeof(localpair_t *));
+	localsocket->backlog = zalloc(backlogsize * sizeof(localpair_t *));
 	if (localsocket->backlog == NULL) {
 		MUTEX_RELEASE(&localsocket->binding->mutex);
 		error = ENOMEM;
@@ -656,11 +656,11 @@ static int localsock_bind(socket_t *socket, sockaddr_t *addr) {
 	char *path = NULL;
 	vnode_t *refnode = NULL;
 
-	binding_t *binding = alloc(sizeof(binding_t));
+	binding_t *binding = zalloc(sizeof(binding_t));
 	if (binding == NULL)
 		return ENOMEM;
 	
-	path = alloc(strlen(addr->path) + 1);
+	path = zalloc(strlen(addr->path) + 1);
 	if (path == NULL) {
 		error = ENOMEM;
 		goto cleanup;
@@ -750,7 +750,7 @@ int localsock_pair(socket_t **ret1, socket_t **ret2) {
 		return ENOMEM;
 	}
 
-	localpair_t *pair = alloc(sizeof(localpair_t));
+	localpair_t *pair = zalloc(sizeof(localpair_t));
 	if (pair == NULL) {
 		localsock_destroy(socket1);
 		localsock_destroy(socket2);
@@ -801,7 +801,7 @@ static socketops_t socketops = {
 
 socket_t *localsock_createsocket() {
 	// XXX possibly move this to a slab?
-	localsocket_t *socket = alloc(sizeof(localsocket_t));
+	localsocket_t *socket = zalloc(sizeof(localsocket_t));
 	if (socket == NULL)
 		return NULL;
 
@@ -269,11 +269,11 @@ static void timeoutdpc(context_t *, dpcarg_t arg) {
 }
 
 static tcb_t *allocatetcb(size_t mtu) {
-	tcb_t *tcb = alloc(sizeof(tcb_t));
+	tcb_t *tcb = zalloc(sizeof(tcb_t));
 	if (tcb == NULL)
 		return NULL;
 
-	tcb->retransmitbuffer = alloc(mtu);
+	tcb->retransmitbuffer = zalloc(mtu);
 	if (tcb->retransmitbuffer == NULL) {
 		free(tcb);
 		return NULL;
@@ -1816,7 +1816,7 @@ static socketops_t socketops = {
 };
 
 socket_t *tcp_createsocket() {
-	tcpsocket_t *socket = alloc(sizeof(tcpsocket_t));
+	tcpsocket_t *socket = zalloc(sizeof(tcpsocket_t));
 	if (socket == NULL)
 		return NULL;
 
@@ -333,7 +333,7 @@ static socketops_t socketops = {
 
 socket_t *udp_createsocket() {
 	// XXX possibly move this to a slab?
-	udpsocket_t *socket = alloc(sizeof(udpsocket_t));
+	udpsocket_t *socket = zalloc(sizeof(udpsocket_t));
 	if (socket == NULL)
 		return NULL;
 
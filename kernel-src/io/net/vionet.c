@@ -174,7 +174,7 @@ int vionet_newdevice(viodevice_t *viodevice) {
 	uint64_t features = virtio_negotiatefeatures(viodevice, WANTED_FEATURES);
 	__assert(features == WANTED_FEATURES);
 
-	vionetdev_t *netdev = alloc(sizeof(vionetdev_t));
+	vionetdev_t *netdev = zalloc(sizeof(vionetdev_t));
 	__assert(netdev);
 	netdev->viodevice = viodevice;
 	netdev->id = id++;
@@ -187,7 +187,7 @@ pcienum_t *pci_getenum(int class, int subclass, int progif, int vendor, int devi
 #define DOESNTEXIST(bus, device, function) (pci_read32(bus, device, function, 0) == 0xffffffff)
 
 static void enumeratefunction(int bus, int device, int function) {
-	pcienum_t *e = alloc(sizeof(pcienum_t));
+	pcienum_t *e = zalloc(sizeof(pcienum_t));
 	__assert(e);
 	e->bus = bus;
 	e->device = device;
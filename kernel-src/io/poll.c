@@ -41,8 +41,11 @@ int poll_initdesc(polldesc_t *desc, size_t size) {
 	SPINLOCK_INIT(desc->lock);
 	SPINLOCK_INIT(desc->eventlock);
 	SPINLOCK_INIT(desc->wakeuplock);
-	for (uintmax_t i = 0; i < size; ++i)
+	// the entries are only fully set up by poll_add, poll_leave only needs to know which ones were added
+	for (uintmax_t i = 0; i < size; ++i) {
 		desc->data[i].desc = desc;
+		desc->data[i].header = NULL;
+	}
 	__assert(spinlock_try(&desc->lock));
 
 	return 0;
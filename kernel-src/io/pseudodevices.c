@@ -3,6 +3,9 @@
 #include <string.h>
 #include <logging.h>
 #include <kernel/timekeeper.h>
+#include <kernel/slab.h>
+#include <kernel/alloc.h>
+#include <util.h>
 
 static int null_write(int minor, void *buffer, size_t count, uintmax_t offset, int flags, size_t *wcount) {
 	*wcount = count;
@@ -40,6 +43,25 @@ static int urandom_read(int minor, void *_buffer, size_t count, uintmax_t offset
 	return 0;
 }
 
+// the text is made again on every read, so reads in pieces can see it change in between
+#define SLABINFO_SIZE (PAGE_SIZE * 4)
+
+static int slabinfo_read(int minor, void *buffer, size_t count, uintmax_t offset, int flags, size_t *rcount) {
+	char *text = alloc(SLABINFO_SIZE);
+	if (text == NULL)
+		return ENOMEM;
+
+	size_t length = min(slab_printstats(text, SLABINFO_SIZE), SLABINFO_SIZE - 1);
+	*rcount = 0;
+	if (offset < length) {
+		*rcount = min(count, length - offset);
+		memcpy(buffer, text + offset, *rcount);
+	}
+
+	free(text);
+	return 0;
+}
+
 static devops_t nullops = {
 	.read = null_read,
 	.write = null_write
@@ -60,9 +82,14 @@ static devops_t urandomops = {
 	.write = null_write
 };
 
+static devops_t slabinfoops = {
+	.read = slabinfo_read
+};
+
 void pseudodevices_init() {
 	__assert(devfs_register(&nullops, "null", V_TYPE_CHDEV, DEV_MAJOR_NULL, 0, 0644) == 0);
 	__assert(devfs_register(&fullops, "full", V_TYPE_CHDEV, DEV_MAJOR_FULL, 0, 0644) == 0);
 	__assert(devfs_register(&zeroops, "zero", V_TYPE_CHDEV, DEV_MAJOR_ZERO, 0, 0644) == 0);
 	__assert(devfs_register(&urandomops, "urandom", V_TYPE_CHDEV, DEV_MAJOR_URANDOM, 0, 0644) == 0);
+	__assert(devfs_register(&slabinfoops, "slabinfo", V_TYPE_CHDEV, DEV_MAJOR_SLABINFO, 0, 0444) == 0);
 }
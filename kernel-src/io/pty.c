@@ -46,7 +46,7 @@ static void freeptyminor(int pty) {
 }
 
 static pty_t *allocpty() {
-	pty_t *pty = alloc(sizeof(pty_t));
+	pty_t *pty = zalloc(sizeof(pty_t));
 	if (pty == NULL)
 		return NULL;
 
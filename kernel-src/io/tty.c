@@ -456,15 +456,15 @@ static devops_t devops = {
 };
 
 tty_t *tty_create(char *name, ttydevicewritefn_t writefn, ttyinactivefn_t inactivefn, void *internal) {
-	tty_t *tty = alloc(sizeof(tty_t));
+	tty_t *tty = zalloc(sizeof(tty_t));
 	if (tty == NULL)
 		return NULL;
 
-	tty->name = alloc(strlen(name) + 1);
+	tty->name = zalloc(strlen(name) + 1);
 	if (tty->name == NULL)
 		goto error;
 
-	tty->devicebuffer = alloc(DEVICE_BUFFER_SIZE);
+	tty->devicebuffer = zalloc(DEVICE_BUFFER_SIZE);
 	if (tty->devicebuffer == NULL)
 		goto error;
 
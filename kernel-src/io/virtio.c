@@ -104,7 +104,7 @@ static void virtio_newdevice(pcienum_t *e) {
 
 	int devtype = e->deviceid - VIRTIO_DEVICE_MIN;
 
-	viodevice_t *viodevice = alloc(sizeof(viodevice_t));
+	viodevice_t *viodevice = zalloc(sizeof(viodevice_t));
 	__assert(viodevice);
 
 	viodevice->e = e;
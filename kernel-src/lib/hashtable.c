@@ -36,7 +36,7 @@ int hashtable_set(hashtable_t *table, void *value, void *key, size_t keysize, bo
 		entry = slab_allocate(hashentrycache);
 		if (entry == NULL)
 			return ENOMEM;
-		entry->key = alloc(keysize);
+		entry->key = zalloc(keysize);
 		if (entry->key == NULL) {
 			slab_free(hashentrycache, entry);
 			return ENOMEM;
@@ -118,7 +118,7 @@ int hashtable_init(hashtable_t *table, size_t size) {
 	}
 
 	table->capacity = size;
-	table->entries = alloc(size * sizeof(hashentry_t *));
+	table->entries = zalloc(size * sizeof(hashentry_t *));
 	if (table->entries == NULL)
 		return ENOMEM;
 
@@ -0,0 +1,270 @@
+#include <radix.h>
+#include <kernel/slab.h>
+#include <string.h>
+#include <logging.h>
+
+#define SLOT(index, shift) (((index) >> (shift)) & (RADIX_SLOTS - 1))
+
+static scache_t *nodecache;
+
+// whether the indexes covered by the node include index
+static inline bool covers(radixnode_t *node, uintmax_t index) {
+	return node->shift + RADIX_SHIFT >= 64 || (index >> (node->shift + RADIX_SHIFT)) == 0;
+}
+
+// the shift of the smallest root that covers index
+static int rootshift(uintmax_t index) {
+	int shift = 0;
+	while (shift + RADIX_SHIFT < 64 && (index >> (shift + RADIX_SHIFT)))
+		shift += RADIX_SHIFT;
+	return shift;
+}
+
+// clears the bits of the index below bit
+static inline uintmax_t alignindex(uintmax_t index, int bit) {
+	return bit >= 64 ? 0 : index & ~(((uintmax_t)1 << bit) - 1);
+}
+
+radixnode_t *radix_allocnodes(size_t count) {
+	if (nodecache == NULL) {
+		nodecache = slab_newcache(sizeof(radixnode_t), 0, NULL, NULL);
+		if (nodecache == NULL)
+			return NULL;
+	}
+
+	radixnode_t *list = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		radixnode_t *node = slab_allocate(nodecache);
+		if (node == NULL) {
+			radix_freenodes(list);
+			return NULL;
+		}
+
+		node->parent = list;
+		list = node;
+	}
+
+	return list;
+}
+
+void radix_freenodes(radixnode_t *list) {
+	while (list) {
+		radixnode_t *node = list;
+		list = list->parent;
+		slab_free(nodecache, node);
+	}
+}
+
+static radixnode_t *takenode(radixnode_t **spare, radixnode_t *parent, int offset, int shift) {
+	radixnode_t *node = *spare;
+	__assert(node);
+	*spare = node->parent;
+	memset(node, 0, sizeof(radixnode_t));
+	node->parent = parent;
+	node->offset = offset;
+	node->shift = shift;
+	return node;
+}
+
+static void putnode(radixnode_t **freed, radixnode_t *node) {
+	node->parent = *freed;
+	*freed = node;
+}
+
+size_t radix_nodesneeded(radix_t *tree, uintmax_t index) {
+	int topshift = rootshift(index);
+	if (tree->root == NULL)
+		return topshift / RADIX_SHIFT + 1;
+
+	if (covers(tree->root, index) == false) {
+		// the tree has to grow up to topshift. the old root goes in the first slot of the chain of new roots,
+		// while the index is in a later slot of the topmost one, so everything under that is new too
+		return (topshift - tree->root->shift) / RADIX_SHIFT + topshift / RADIX_SHIFT;
+	}
+
+	radixnode_t *node = tree->root;
+	while (node->shift > 0) {
+		radixnode_t *child = node->slots[SLOT(index, node->shift)];
+		if (child == NULL)
+			return node->shift / RADIX_SHIFT;
+		node = child;
+	}
+
+	return 0;
+}
+
+// sets the tag bit of the slot and of every node above it
+static void propagatetag(radixnode_t *node, int slot, int tag) {
+	while (node) {
+		bool wasset = node->tags[tag] != 0;
+		node->tags[tag] |= (uint64_t)1 << slot;
+		if (wasset)
+			break;
+		slot = node->offset;
+		node = node->parent;
+	}
+}
+
+// clears the tag bit of the slot and of every node above it that has nothing else tagged
+static void untag(radixnode_t *node, int slot, int tag) {
+	while (node) {
+		node->tags[tag] &= ~((uint64_t)1 << slot);
+		if (node->tags[tag])
+			break;
+		slot = node->offset;
+		node = node->parent;
+	}
+}
+
+void radix_insert(radix_t *tree, uintmax_t index, void *item, radixnode_t **spare) {
+	__assert(item);
+	if (tree->root == NULL)
+		tree->root = takenode(spare, NULL, 0, rootshift(index));
+
+	// grow the tree until the root covers the index, with the old root as the first child of the new one
+	while (covers(tree->root, index) == false) {
+		radixnode_t *oldroot = tree->root;
+		radixnode_t *root = takenode(spare, NULL, 0, oldroot->shift + RADIX_SHIFT);
+		root->slots[0] = oldroot;
+		root->used = 1;
+		for (int i = 0; i < RADIX_TAG_COUNT; ++i)
+			root->tags[i] = oldroot->tags[i] ? 1 : 0;
+
+		oldroot->parent = root;
+		oldroot->offset = 0;
+		tree->root = root;
+	}
+
+	radixnode_t *node = tree->root;
+	while (node->shift > 0) {
+		int slot = SLOT(index, node->shift);
+		if (node->slots[slot] == NULL) {
+			node->slots[slot] = takenode(spare, node, slot, node->shift - RADIX_SHIFT);
+			node->used |= (uint64_t)1 << slot;
+		}
+		node = node->slots[slot];
+	}
+
+	int slot = SLOT(index, 0);
+	__assert(node->slots[slot] == NULL);
+	node->slots[slot] = item;
+	node->used |= (uint64_t)1 << slot;
+}
+
+static radixnode_t *getleaf(radix_t *tree, uintmax_t index) {
+	radixnode_t *node = tree->root;
+	if (node == NULL || covers(node, index) == false)
+		return NULL;
+
+	while (node && node->shift > 0)
+		node = node->slots[SLOT(index, node->shift)];
+
+	return node;
+}
+
+void *radix_lookup(radix_t *tree, uintmax_t index) {
+	radixnode_t *leaf = getleaf(tree, index);
+	return leaf ? leaf->slots[SLOT(index, 0)] : NULL;
+}
+
+void *radix_remove(radix_t *tree, uintmax_t index, radixnode_t **freed) {
+	radixnode_t *node = getleaf(tree, index);
+	int slot = SLOT(index, 0);
+	if (node == NULL || node->slots[slot] == NULL)
+		return NULL;
+
+	void *item = node->slots[slot];
+	for (int i = 0; i < RADIX_TAG_COUNT; ++i) {
+		if (node->tags[i] & ((uint64_t)1 << slot))
+			untag(node, slot, i);
+	}
+
+	node->slots[slot] = NULL;
+	node->used &= ~((uint64_t)1 << slot);
+
+	// free the nodes that were left empty
+	while (node->used == 0) {
+		radixnode_t *parent = node->parent;
+		putnode(freed, node);
+		if (parent == NULL) {
+			tree->root = NULL;
+			return item;
+		}
+
+		parent->slots[node->offset] = NULL;
+		parent->used &= ~((uint64_t)1 << node->offset);
+		node = parent;
+	}
+
+	// and shrink the tree while the root only has its first slot used
+	while (tree->root->shift > 0 && tree->root->used == 1) {
+		radixnode_t *root = tree->root;
+		tree->root = root->slots[0];
+		tree->root->parent = NULL;
+		tree->root->offset = 0;
+		putnode(freed, root);
+	}
+
+	return item;
+}
+
+// returns the first item at or after *index (only tagged ones if tag isn't RADIX_TAG_NONE), and sets *index to where it is
+void *radix_next(radix_t *tree, uintmax_t *indexp, int tag) {
+	uintmax_t index = *indexp;
+	radixnode_t *node = tree->root;
+	if (node == NULL || covers(node, index) == false)
+		return NULL;
+
+	for (;;) {
+		int slot = SLOT(index, node->shift);
+		uint64_t mask = (tag == RADIX_TAG_NONE ? node->used : node->tags[tag]) & (~(uint64_t)0 << slot);
+
+		if (mask == 0) {
+			// nothing left in this node, continue from the start of the next one, in the first node above that covers it
+			if (node->parent == NULL)
+				return NULL;
+
+			uintmax_t next = alignindex(index, node->shift + RADIX_SHIFT) + ((uintmax_t)1 << (node->shift + RADIX_SHIFT));
+			if (next <= index)
+				return NULL;
+
+			do {
+				node = node->parent;
+				if (node == NULL)
+					return NULL;
+			} while (alignindex(next, node->shift + RADIX_SHIFT) != alignindex(index, node->shift + RADIX_SHIFT));
+
+			index = next;
+			continue;
+		}
+
+		int found = __builtin_ctzll(mask);
+		if (found != slot)
+			index = alignindex(index, node->shift + RADIX_SHIFT) | ((uintmax_t)found << node->shift);
+
+		if (node->shift == 0) {
+			*indexp = index;
+			return node->slots[found];
+		}
+
+		node = node->slots[found];
+	}
+}
+
+void radix_settag(radix_t *tree, uintmax_t index, int tag) {
+	radixnode_t *leaf = getleaf(tree, index);
+	__assert(leaf && leaf->slots[SLOT(index, 0)]);
+	propagatetag(leaf, SLOT(index, 0), tag);
+}
+
+void radix_cleartag(radix_t *tree, uintmax_t index, int tag) {
+	radixnode_t *leaf = getleaf(tree, index);
+	int slot = SLOT(index, 0);
+	if (leaf && (leaf->tags[tag] & ((uint64_t)1 << slot)))
+		untag(leaf, slot, tag);
+}
+
+bool radix_gettag(radix_t *tree, uintmax_t index, int tag) {
+	radixnode_t *leaf = getleaf(tree, index);
+	return leaf && (leaf->tags[tag] & ((uint64_t)1 << SLOT(index, 0)));
+}
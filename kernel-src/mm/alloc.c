@@ -1,66 +1,110 @@
 #include <kernel/alloc.h>
 #include <kernel/slab.h>
+#include <kernel/vmm.h>
 #include <logging.h>
 #include <string.h>
+#include <util.h>
 
 // each allocation has the following structure:
 // ptr: data capacity (allocsizes size)
 // ptr + sizeof(size_t): current size
 // ptr + sizeof(size_t) * 2: data
 // ptr + datasize: poison value
+//
+// allocations bigger than the biggest cache are mapped directly with vmm_map
+// and have the same header, with the capacity being the rest of the mapping.
+// memory is only zeroed when asked for with zalloc() or when growing with realloc()
 
 #define USE_POISON 0
 #define POISON_VALUE 0xdeadbeefbadc0ffel
-#define CACHE_COUNT 12
+#define CACHE_COUNT 23
+#define HEADER_SIZE (sizeof(size_t) * 2)
 
-#define CAPACITY_SIZE(cache) cache->size - sizeof(size_t) * 2 - USE_POISON * sizeof(size_t)
+#define CAPACITY_SIZE(cache) cache->size - HEADER_SIZE - USE_POISON * sizeof(size_t)
+#define LARGEST_SIZE allocsizes[CACHE_COUNT - 1]
 
-static size_t allocsizes[CACHE_COUNT] = {32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536};
+// powers of two from 32 bytes to 64k with an extra class halfway between each of them
+static size_t allocsizes[CACHE_COUNT] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+	2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536
+};
 static scache_t *caches[CACHE_COUNT];
 
 static void initarea(scache_t *cache, void *obj) {
 	size_t *ptr = obj;
 	*ptr = CAPACITY_SIZE(cache);
-	memset(ptr + 2, 0, *ptr);
 	#if USE_POISON == 1
 	*((size_t *)((uintptr_t)obj + cache->size - sizeof(size_t))) = POISON_VALUE;
 	#endif
 }
 
-static void dtor(scache_t *cache, void *obj) {
 #if USE_POISON == 1
+static void dtor(scache_t *cache, void *obj) {
 	__assert(*(size_t *)((uintptr_t)obj + cache->size - sizeof(size_t)) == POISON_VALUE);
-#endif
-	initarea(cache, obj);
 }
+#else
+#define dtor NULL
+#endif
 
 static scache_t *getcachefromsize(size_t size) {
-	scache_t *cache = NULL;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (size <= allocsizes[i]) {
-			cache = caches[i];
-			break;
-		}
-	}
-	__assert(cache);
-	return cache;
+	if (size <= allocsizes[0])
+		return caches[0];
+
+	__assert(size <= LARGEST_SIZE);
+
+	// size is in (2^k, 2^(k+1)], pick either 1.5 * 2^k or 2^(k+1)
+	int k = log2(size - 1);
+	int index = size <= ((size_t)3 << (k - 1)) ? (k - 5) * 2 + 1 : (k - 4) * 2;
+	return caches[index];
 }
 
-void *alloc(size_t size) {
-	scache_t *cache = getcachefromsize(size);
-	size_t *ret = slab_allocate(cache);
+static void *largealloc(size_t size) {
+	size_t mapsize = ROUND_UP(size + HEADER_SIZE, PAGE_SIZE);
+	size_t *ret = vmm_map(NULL, mapsize, VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
 	if (ret == NULL)
 		return NULL;
-	__assert(*ret == CAPACITY_SIZE(cache));
+
+	*ret = mapsize - HEADER_SIZE;
+	return ret;
+}
+
+void *alloc(size_t size) {
+	size_t *ret;
+	if (size > LARGEST_SIZE) {
+		ret = largealloc(size);
+		if (ret == NULL)
+			return NULL;
+	} else {
+		scache_t *cache = getcachefromsize(size);
+		ret = slab_allocate(cache);
+		if (ret == NULL)
+			return NULL;
+		__assert(*ret == CAPACITY_SIZE(cache));
+	}
+
 	*(ret + 1) = size;
 	return ret + 2;
 }
 
+void *zalloc(size_t size) {
+	void *ret = alloc(size);
+	// the large allocation path gets zeroed pages from vmm_map already
+	if (ret && size <= LARGEST_SIZE)
+		memset(ret, 0, size);
+
+	return ret;
+}
+
 void free(void *ptr) {
 	size_t *start = ptr;
 	start -= 2;
-	size_t size = *start;
-	scache_t *cache = getcachefromsize(size);
+	size_t capacity = *start;
+	if (capacity > LARGEST_SIZE) {
+		vmm_unmap(start, capacity + HEADER_SIZE, 0);
+		return;
+	}
+
+	scache_t *cache = getcachefromsize(capacity);
 	slab_free(cache, start);
 }
 
@@ -73,12 +117,8 @@ void *realloc(void *ptr, size_t size) {
 		return ptr;
 	}
 
-	// grow
-	scache_t *oldcache = getcachefromsize(*start);
-	scache_t *newcache = getcachefromsize(size);
-
-	// same allocation
-	if (oldcache == newcache) {
+	// grow in place
+	if (size <= *start) {
 		size_t diff = size - currentsize;
 		memset((void *)((uintptr_t)ptr + currentsize), 0, diff);
 		*(start + 1) = size;
@@ -86,18 +126,19 @@ void *realloc(void *ptr, size_t size) {
 	}
 
 	// different allocation
-	size_t *new = slab_allocate(newcache);
+	void *new = alloc(size);
 	if (new == NULL)
 		return NULL;
-	*(new + 1) = size;
-	memcpy((new + 2), ptr, currentsize);
-	slab_free(oldcache, start);
-	return new + 2;
+
+	memcpy(new, ptr, currentsize);
+	memset((void *)((uintptr_t)new + currentsize), 0, size - currentsize);
+	free(ptr);
+	return new;
 }
 
 void alloc_init() {
 	for (int i = 0; i < CACHE_COUNT; ++i) {
-		caches[i] = slab_newcache(allocsizes[i] + sizeof(size_t) * 2 + sizeof(size_t) * USE_POISON, 0, initarea, dtor);
+		caches[i] = slab_newcache(allocsizes[i] + HEADER_SIZE + sizeof(size_t) * USE_POISON, 0, initarea, dtor);
 		__assert(caches[i]);
 	}
 }
@@ -6,6 +6,8 @@
 #include <mutex.h>
 #include <util.h>
 #include <kernel/vmmcache.h>
+#include <arch/cpu.h>
+#include <kernel/shrinker.h>
 
 uintptr_t hhdmbase;
 static size_t memorysize;
@@ -13,26 +15,50 @@ static size_t pagecount;
 size_t freepagecount;
 
 static mutex_t freelistmutex;
-static page_t *freelists[PMM_SECTION_COUNT];
-static page_t *freetails[PMM_SECTION_COUNT];
-static page_t *standbylists[PMM_SECTION_COUNT];
-static page_t *standbytails[PMM_SECTION_COUNT];
+static page_t *buddylists[PMM_SECTION_COUNT][PMM_ORDER_COUNT];
+static size_t standbycount;
 
+// standby pages are in one of two lists per section. pages only get into the active list after being
+// used more than once, and reclaim takes from the inactive one first, so pages that are only streamed through
+// once can't push the ones that are used often out of the cache
 typedef struct {
-	uintmax_t baseid;
-	uintmax_t topid;
-	uintmax_t searchstart;
-} section_t;
+	page_t *head;
+	page_t *tail;
+	size_t count;
+} standbylist_t;
+
+static standbylist_t activelists[PMM_SECTION_COUNT];
+static standbylist_t inactivelists[PMM_SECTION_COUNT];
+
+// how many standby pages are looked at before giving up and taking whatever is at the end of the lists
+#define RECLAIM_SCAN_MAX 32
+
+// per-cpu lists of free PMM_SECTION_DEFAULT pages. the head is the hot end (recently freed, likely still
+// in the cpu cache) and the tail is the cold end, where pages are refilled into and drained from in batches.
+// only touched by their own cpu with interrupts disabled, the lock is there for draining from other cpus.
+typedef struct {
+	spinlock_t lock;
+	page_t *head;
+	page_t *tail;
+	size_t count;
+} __attribute__((aligned(64))) pmmcpu_t;
+
+#define PCP_BATCH 32
+#define PCP_HIGH (PCP_BATCH * 4)
+
+static pmmcpu_t cpucaches[ARCH_MAX_CPUS];
+
+// free pages zeroed ahead of time by the idle threads, linked by freenext.
+// they are not counted in freepagecount
+#define ZEROED_HIGH 1024
+
+static spinlock_t zeroedlock;
+static page_t *zeroedlist;
+static size_t zeroedcount;
 
 #define TOP_1MB (0x100000 / PAGE_SIZE)
 #define TOP_4GB ((uint64_t)0x100000000 / PAGE_SIZE)
 
-static section_t sections[PMM_SECTION_COUNT] = {
-	{0, TOP_1MB, 0},
-	{TOP_1MB, TOP_4GB, TOP_1MB},
-	{TOP_4GB, 0xffffffffffffffffl, TOP_4GB}
-};
-
 static volatile struct limine_hhdm_request hhdmreq = {
 	.id = LIMINE_HHDM_REQUEST,
 	.revision = 0
@@ -49,69 +75,172 @@ static page_t* pages;
 #define PAGE_BOUNDARYCHECK(pageid) \
 	__assert((pageid) * PAGE_SIZE < (uintptr_t)pages || (pageid) * PAGE_SIZE >= (uintptr_t)&pages[pagecount])
 
-static void insertinfreelist(page_t *page) {
-	uintmax_t pageid = PAGE_GETID(page);
-	PAGE_BOUNDARYCHECK(pageid);
-	struct page_t **list;
-	struct page_t **tail;
-
-	int section;
-
+static inline int getsection(uintmax_t pageid) {
 	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
+		return PMM_SECTION_1MB;
 	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
+		return PMM_SECTION_4GB;
 	else
-		section = PMM_SECTION_DEFAULT;
-
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
-
-	if (sections[section].searchstart > pageid)
-		sections[section].searchstart = pageid;
+		return PMM_SECTION_DEFAULT;
+}
 
-	page->freenext = *list;
+static void buddyinsert(page_t *page, int section, int order) {
+	page->flags |= PAGE_FLAGS_FREE;
+	page->order = order;
 	page->freeprev = NULL;
-	*list = page;
+	page->freenext = buddylists[section][order];
 	if (page->freenext)
 		page->freenext->freeprev = page;
+	buddylists[section][order] = page;
+}
+
+static void buddyremove(page_t *page, int section, int order) {
+	if (page->freeprev)
+		page->freeprev->freenext = page->freenext;
 	else
-		*tail = page;
+		buddylists[section][order] = page->freenext;
 
-	++freepagecount;
+	if (page->freenext)
+		page->freenext->freeprev = page->freeprev;
+
+	page->flags &= ~PAGE_FLAGS_FREE;
+	page->freenext = NULL;
+	page->freeprev = NULL;
 }
 
-static void removefromfreelist(page_t *page) {
+// gives a block of 2^order pages back to its section, merging it with its buddies while they are free
+static void buddyfree(uintmax_t pageid, int order) {
+	int section = getsection(pageid);
+	freepagecount += (size_t)1 << order;
+
+	while (order < PMM_MAX_ORDER) {
+		uintmax_t buddyid = pageid ^ ((uintmax_t)1 << order);
+		if (buddyid >= pagecount || getsection(buddyid) != section)
+			break;
+
+		page_t *buddy = &pages[buddyid];
+		if ((buddy->flags & PAGE_FLAGS_FREE) == 0 || buddy->order != order)
+			break;
+
+		buddyremove(buddy, section, order);
+		pageid &= ~((uintmax_t)1 << order);
+		++order;
+	}
+
+	buddyinsert(&pages[pageid], section, order);
+}
+
+// takes a block of 2^order pages from a section, splitting bigger blocks if needed
+static page_t *buddyalloc(int section, int order) {
+	int found = order;
+	while (found <= PMM_MAX_ORDER && buddylists[section][found] == NULL)
+		++found;
+
+	if (found > PMM_MAX_ORDER)
+		return NULL;
+
+	page_t *page = buddylists[section][found];
+	buddyremove(page, section, found);
+
+	// give back the upper halves
 	uintmax_t pageid = PAGE_GETID(page);
-	PAGE_BOUNDARYCHECK(pageid);
-	struct page_t **list;
-	struct page_t **tail;
+	while (found > order) {
+		--found;
+		buddyinsert(&pages[pageid + ((uintmax_t)1 << found)], section, found);
+	}
 
-	int section;
+	freepagecount -= (size_t)1 << order;
+	return page;
+}
 
-	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
-	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
+static void standbyinsert(standbylist_t *list, page_t *page) {
+	page->freenext = list->head;
+	page->freeprev = NULL;
+	list->head = page;
+	if (page->freenext)
+		page->freenext->freeprev = page;
 	else
-		section = PMM_SECTION_DEFAULT;
+		list->tail = page;
 
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
+	++list->count;
+}
 
+static void standbyremove(standbylist_t *list, page_t *page) {
 	if (page->freeprev)
 		page->freeprev->freenext = page->freenext;
 	else
-		*list = page->freenext;
+		list->head = page->freenext;
 
 	if (page->freenext)
 		page->freenext->freeprev = page->freeprev;
 	else
-		*tail = page->freeprev;
+		list->tail = page->freeprev;
+
+	--list->count;
+}
+
+static void insertinfreelist(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+
+	if (page->backing == NULL) {
+		buddyfree(pageid, 0);
+		return;
+	}
+
+	// standby pages keep their page cache contents and are only reused when there are no free pages
+	int section = getsection(pageid);
+	standbyinsert(page->flags & PAGE_FLAGS_ACTIVE ? &activelists[section] : &inactivelists[section], page);
+
+	++standbycount;
+	++freepagecount;
+}
+
+// only used for standby pages, free pages are taken with buddyalloc
+static void removefromfreelist(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+	__assert(page->backing);
 
+	int section = getsection(pageid);
+	standbyremove(page->flags & PAGE_FLAGS_ACTIVE ? &activelists[section] : &inactivelists[section], page);
+
+	--standbycount;
 	--freepagecount;
 }
 
+// assumes freelistmutex is held. picks the standby page of a section that should be reclaimed next.
+// before that, the active list is aged into the inactive list so it doesn't grow past it. pages at the end of
+// the active list that were used again since they got there get another go around it
+static page_t *standbyvictim(int section) {
+	standbylist_t *active = &activelists[section];
+	standbylist_t *inactive = &inactivelists[section];
+
+	for (int i = 0; i < RECLAIM_SCAN_MAX && active->count > inactive->count; ++i) {
+		page_t *page = active->tail;
+		standbyremove(active, page);
+		if (page->flags & PAGE_FLAGS_REFERENCED) {
+			page->flags &= ~PAGE_FLAGS_REFERENCED;
+			standbyinsert(active, page);
+		} else {
+			page->flags &= ~PAGE_FLAGS_ACTIVE;
+			standbyinsert(inactive, page);
+		}
+	}
+
+	return inactive->tail ? inactive->tail : active->tail;
+}
+
+// called with the page held when a page cache page is used. the first use marks it as referenced
+// and the second one makes it active, so it goes in the active list when released
+void pmm_markaccessed(page_t *page) {
+	int flags = __atomic_load_n(&page->flags, __ATOMIC_SEQ_CST);
+	if (flags & (PAGE_FLAGS_ACTIVE | PAGE_FLAGS_REFERENCED))
+		__atomic_or_fetch(&page->flags, PAGE_FLAGS_ACTIVE | PAGE_FLAGS_REFERENCED, __ATOMIC_SEQ_CST);
+	else
+		__atomic_or_fetch(&page->flags, PAGE_FLAGS_REFERENCED, __ATOMIC_SEQ_CST);
+}
+
 static void internalhold(page_t *page) {
 	__atomic_add_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 	if (page->refcount == 1) {
@@ -132,11 +261,163 @@ void *pmm_getpageaddress(page_t *page) {
 void pmm_hold(void *addr) {
 	page_t *page = &pages[((uintptr_t)addr / PAGE_SIZE)];
 
+	// pages that are already referenced can't be in any list, so no lock is needed for them
+	uintmax_t refcount = __atomic_load_n(&page->refcount, __ATOMIC_SEQ_CST);
+	while (refcount) {
+		if (__atomic_compare_exchange_n(&page->refcount, &refcount, refcount + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+	}
+
 	MUTEX_ACQUIRE(&freelistmutex, false);
 	internalhold(page);
 	MUTEX_RELEASE(&freelistmutex);
 }
 
+static void cpucacheappend(pmmcpu_t *cache, page_t *list, page_t *last, size_t count) {
+	list->freeprev = cache->tail;
+	if (cache->tail)
+		cache->tail->freenext = list;
+	else
+		cache->head = list;
+
+	cache->tail = last;
+	cache->count += count;
+}
+
+// removes count pages from the cold end of a cpu cache and returns them as a list linked by freenext
+static page_t *cpucachedetach(pmmcpu_t *cache, size_t count) {
+	page_t *list = cache->tail;
+	for (size_t i = 1; i < count; ++i)
+		list = list->freeprev;
+
+	cache->tail = list->freeprev;
+	if (cache->tail)
+		cache->tail->freenext = NULL;
+	else
+		cache->head = NULL;
+
+	cache->count -= count;
+	return list;
+}
+
+// returns a list of pages taken from the cpu caches to the buddy lists
+static void drainlist(page_t *list) {
+	if (list == NULL)
+		return;
+
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	while (list) {
+		page_t *page = list;
+		list = list->freenext;
+		insertinfreelist(page);
+	}
+	MUTEX_RELEASE(&freelistmutex);
+}
+
+// empties the cpu caches of every cpu, so their pages can be coalesced or used by other cpus
+static void drainallcpus() {
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+		pmmcpu_t *cache = &cpucaches[i];
+		bool intstatus = interrupt_set(false);
+		spinlock_acquire(&cache->lock);
+		page_t *list = cache->count ? cpucachedetach(cache, cache->count) : NULL;
+		spinlock_release(&cache->lock);
+		interrupt_set(intstatus);
+		drainlist(list);
+	}
+}
+
+// puts a free anonymous page in the hot end of the current cpu cache, draining a batch if it got too big
+static void cpucachefree(page_t *page) {
+	page_t *drain = NULL;
+	bool intstatus = interrupt_set(false);
+	pmmcpu_t *cache = &cpucaches[_cpu()->number];
+	spinlock_acquire(&cache->lock);
+
+	page->freeprev = NULL;
+	page->freenext = cache->head;
+	if (cache->head)
+		cache->head->freeprev = page;
+	else
+		cache->tail = page;
+	cache->head = page;
+	++cache->count;
+
+	if (cache->count > PCP_HIGH)
+		drain = cpucachedetach(cache, PCP_BATCH);
+
+	spinlock_release(&cache->lock);
+	interrupt_set(intstatus);
+
+	drainlist(drain);
+}
+
+// takes a page from the hot end of the current cpu cache, refilling it from the buddy lists if it's empty
+static page_t *cpucacheallocate() {
+	bool intstatus = interrupt_set(false);
+	pmmcpu_t *cache = &cpucaches[_cpu()->number];
+	spinlock_acquire(&cache->lock);
+
+	page_t *page = cache->head;
+	if (page) {
+		cache->head = page->freenext;
+		if (cache->head)
+			cache->head->freeprev = NULL;
+		else
+			cache->tail = NULL;
+		--cache->count;
+	}
+
+	spinlock_release(&cache->lock);
+	interrupt_set(intstatus);
+
+	if (page)
+		return page;
+
+	// refill
+	page_t *list = NULL;
+	page_t *last = NULL;
+	size_t count = 0;
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	for (; count < PCP_BATCH + 1; ++count) {
+		page_t *new = NULL;
+		for (int i = PMM_SECTION_DEFAULT; i >= 0 && new == NULL; --i)
+			new = buddyalloc(i, 0);
+
+		if (new == NULL)
+			break;
+
+		new->freenext = NULL;
+		new->freeprev = last;
+		if (last)
+			last->freenext = new;
+		else
+			list = new;
+		last = new;
+	}
+	MUTEX_RELEASE(&freelistmutex);
+
+	if (list == NULL)
+		return NULL;
+
+	// keep the first page for ourselves
+	page = list;
+	list = list->freenext;
+	--count;
+
+	if (list) {
+		list->freeprev = NULL;
+		intstatus = interrupt_set(false);
+		cache = &cpucaches[_cpu()->number];
+		spinlock_acquire(&cache->lock);
+		cpucacheappend(cache, list, last, count);
+		spinlock_release(&cache->lock);
+		interrupt_set(intstatus);
+	}
+
+	return page;
+}
+
 void pmm_release(void *addr) {
 	page_t *page = &pages[(uintptr_t)addr / PAGE_SIZE];
 	__assert(page->refcount != 0);
@@ -144,10 +425,13 @@ void pmm_release(void *addr) {
 	uintmax_t newrefcount = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 	if (newrefcount == 0) {
 		__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
+		if (page->backing == NULL && getsection(PAGE_GETID(page)) == PMM_SECTION_DEFAULT) {
+			cpucachefree(page);
+			return;
+		}
+
 		MUTEX_ACQUIRE(&freelistmutex, false);
 		insertinfreelist(page);
-		if (page->backing == NULL)
-			page->flags |= PAGE_FLAGS_FREE;
 		MUTEX_RELEASE(&freelistmutex);
 	}
 }
@@ -158,27 +442,122 @@ static void doalloc(page_t *page) {
 	page->refcount = 1;
 }
 
+static page_t *zeroedallocate() {
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&zeroedlock);
+	page_t *page = zeroedlist;
+	if (page) {
+		zeroedlist = page->freenext;
+		--zeroedcount;
+	}
+	spinlock_release(&zeroedlock);
+	interrupt_set(intstatus);
+	return page;
+}
+
+// returns the zeroed pages to the buddy lists
+static void drainzeroed() {
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&zeroedlock);
+	page_t *list = zeroedlist;
+	zeroedlist = NULL;
+	zeroedcount = 0;
+	spinlock_release(&zeroedlock);
+	interrupt_set(intstatus);
+
+	drainlist(list);
+}
+
+// called by the idle threads. zeroes a free page into the zeroed list, returns false if there was nothing to do.
+// as the idle thread can't sleep, the free list mutex is only tried
+bool pmm_zeroidle() {
+	if (zeroedcount >= ZEROED_HIGH || MUTEX_TRY(&freelistmutex) == false)
+		return false;
+
+	// low memory is left alone, it's too scarce to sit in the zeroed list
+	page_t *page = NULL;
+	for (int i = PMM_SECTION_DEFAULT; i > PMM_SECTION_1MB && page == NULL; --i)
+		page = buddyalloc(i, 0);
+
+	MUTEX_RELEASE(&freelistmutex);
+
+	if (page == NULL)
+		return false;
+
+	memset(MAKE_HHDM(pmm_getpageaddress(page)), 0, PAGE_SIZE);
+
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&zeroedlock);
+	page->freenext = zeroedlist;
+	zeroedlist = page;
+	++zeroedcount;
+	spinlock_release(&zeroedlock);
+	interrupt_set(intstatus);
+	return true;
+}
+
+#define SHRINK_BATCH 64
+
 void *pmm_allocpage(int section) {
+	bool zero = section & PMM_FLAGS_ZERO;
+	bool noreclaim = section & PMM_FLAGS_NORECLAIM;
+	section &= PMM_SECTION_MASK;
+	page_t *page = NULL;
+	// without reclaiming, only the free lists are looked at
+	bool drained = noreclaim;
+	bool shrunk = false;
+	bool zeroed = false;
+
+	again:
+	if (section == PMM_SECTION_DEFAULT) {
+		if (zero) {
+			page = zeroedallocate();
+			if (page) {
+				zeroed = true;
+				goto gotpage;
+			}
+		}
+
+		page = cpucacheallocate();
+		if (page)
+			goto gotpage;
+	}
+
 	retry:
 	MUTEX_ACQUIRE(&freelistmutex, false);
-	page_t *page = NULL;
 
 	// try to take a free anonymous page
 	for (int i = section; i >= 0; --i) {
-		page = freelists[i];
+		page = buddyalloc(i, 0);
 		if (page) {
-			removefromfreelist(page);
 			__assert(page->refcount == 0);
 			break;
 		}
 	}
 
+	// pages zeroed in advance are still free pages
+	if (page == NULL && section == PMM_SECTION_DEFAULT) {
+		page = zeroedallocate();
+		zeroed = page != NULL;
+	}
+
+	// other cpus might be holding on to free pages, get them back before touching the page cache
+	if (page == NULL && drained == false) {
+		MUTEX_RELEASE(&freelistmutex);
+		drained = true;
+		drainallcpus();
+		// the idle threads also zero 4gb section pages, but only default allocations take from the zeroed list
+		if (section == PMM_SECTION_4GB)
+			drainzeroed();
+		goto retry;
+	}
+
 	bool cachepage = false;
 
 	// if that wasn't possible, try to take from the cache standby list
-	if (page == NULL) {
+	if (page == NULL && noreclaim == false) {
 		for (int i = section; i >= 0; --i) {
-			page = standbytails[i];
+			page = standbyvictim(i);
 			if (page) {
 				cachepage = true;
 				internalhold(page);
@@ -189,6 +568,15 @@ void *pmm_allocpage(int section) {
 
 	MUTEX_RELEASE(&freelistmutex);
 
+	// nothing free and nothing in standby, ask the rest of the kernel to give some memory back
+	if (page == NULL && shrunk == false && noreclaim == false) {
+		shrunk = true;
+		if (shrinker_run(SHRINK_BATCH)) {
+			drained = false;
+			goto again;
+		}
+	}
+
 	if (cachepage && vmmcache_takepage(page) == EAGAIN) {
 		// someone already got the page from the cache between us holding it and taking it
 		pmm_release(pmm_getpageaddress(page));
@@ -201,25 +589,43 @@ void *pmm_allocpage(int section) {
 		page->refcount = 0;
 	}
 
+	gotpage:
 	void *address = NULL;
 	if (page) {
 		address = (void *)(PAGE_GETID(page) * PAGE_SIZE);
 		doalloc(page);
+		if (zero && zeroed == false)
+			memset(MAKE_HHDM(address), 0, PAGE_SIZE);
 	}
 
 	return address;
 }
 
+// frees the range [baseid, topid) in the biggest aligned blocks possible
+static void freerange(uintmax_t baseid, uintmax_t topid) {
+	uintmax_t pageid = baseid;
+	while (pageid < topid) {
+		int order = 0;
+		while (order < PMM_MAX_ORDER) {
+			uintmax_t size = (uintmax_t)1 << (order + 1);
+			if ((pageid & (size - 1)) || pageid + size > topid || getsection(pageid) != getsection(pageid + size - 1))
+				break;
+			++order;
+		}
+
+		PAGE_BOUNDARYCHECK(pageid);
+		buddyfree(pageid, order);
+		pageid += (uintmax_t)1 << order;
+	}
+}
+
 void pmm_makefree(void *address, size_t count) {
-	memorysize += PAGE_SIZE * count;
 	__assert(((uintptr_t)address % PAGE_SIZE) == 0);
 	uintmax_t baseid = (uintptr_t)address / PAGE_SIZE;
-	for (int i = 0; i < count; ++i) {
-		uintmax_t pageid = baseid + i;
-		PAGE_BOUNDARYCHECK(pageid);
-		page_t *page = &pages[pageid];
-		insertinfreelist(page);
-	}
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	memorysize += PAGE_SIZE * count;
+	freerange(baseid, baseid + count);
+	MUTEX_RELEASE(&freelistmutex);
 }
 
 void pmm_init() {
@@ -251,22 +657,62 @@ void pmm_init() {
 	memset(pages, 0, pagecount * sizeof(page_t));
 	printf("pmm: %d pages used for page list\n", ROUND_UP(pagecount * sizeof(page_t), PAGE_SIZE) / PAGE_SIZE);
 
-	// place pages in free lists
+	// place pages in the buddy lists
 	for (size_t i = 0; i < pmm_liminemap.response->entry_count; ++i) {
 		struct limine_memmap_entry *e = pmm_liminemap.response->entries[i];
 		if (e->type == LIMINE_MEMMAP_USABLE) {
-			int firstusablepage = e == biggest ? ROUND_UP(e->base + pagecount * sizeof(page_t), PAGE_SIZE) / PAGE_SIZE : e->base / PAGE_SIZE;
-			for (int i = firstusablepage; i < (e->base + e->length) / PAGE_SIZE; ++i) {
-				pages[i].flags |= PAGE_FLAGS_FREE;
-				insertinfreelist(&pages[i]);
-			}
+			uintmax_t firstusablepage = e == biggest ? ROUND_UP(e->base + pagecount * sizeof(page_t), PAGE_SIZE) / PAGE_SIZE : e->base / PAGE_SIZE;
+			freerange(firstusablepage, (e->base + e->length) / PAGE_SIZE);
 		}
 	}
 
 	MUTEX_INIT(&freelistmutex);
+	SPINLOCK_INIT(zeroedlock);
 }
 
-// XXX pmm_alloc won't be able to take pages from the page cache when the allocation size is over 1 page
+// moves up to count standby pages back into the buddy lists, used by the page cache shrinker.
+// returns how many pages were reclaimed
+size_t pmm_reclaimstandby(size_t count) {
+	size_t reclaimed = 0;
+	while (reclaimed < count) {
+		MUTEX_ACQUIRE(&freelistmutex, false);
+		page_t *page = NULL;
+		for (int i = PMM_SECTION_DEFAULT; i >= 0; --i) {
+			page = standbyvictim(i);
+			if (page) {
+				internalhold(page);
+				break;
+			}
+		}
+		MUTEX_RELEASE(&freelistmutex);
+
+		if (page == NULL)
+			break;
+
+		if (vmmcache_takepage(page) == EAGAIN) {
+			// someone got the page from the cache while the lock wasn't held, it is no longer standby
+			pmm_release(pmm_getpageaddress(page));
+			continue;
+		}
+
+		// the page is anonymous now and we hold the only reference to it
+		page->refcount = 0;
+		doalloc(page);
+		pmm_release(pmm_getpageaddress(page));
+		++reclaimed;
+	}
+
+	return reclaimed;
+}
+
+size_t pmm_standbycount() {
+	return standbycount;
+}
+
+// usable memory in pages
+size_t pmm_totalpages() {
+	return memorysize / PAGE_SIZE;
+}
 
 void *pmm_alloc(size_t size, int section) {
 	__assert(size);
@@ -274,40 +720,59 @@ void *pmm_alloc(size_t size, int section) {
 	if (size == 1)
 		return pmm_allocpage(section);
 
-	MUTEX_ACQUIRE(&freelistmutex, false);
+	bool zero = section & PMM_FLAGS_ZERO;
+	bool noreclaim = section & PMM_FLAGS_NORECLAIM;
+	section &= PMM_SECTION_MASK;
 
-	uintmax_t page = 0;
-	size_t found = 0;
+	int order = log2(size);
+	if (((size_t)1 << order) < size)
+		++order;
 
-	for (; section >= 0; --section) {
-		for (page = sections[section].searchstart; page < sections[section].topid; ++page) {
-			if (page >= pagecount)
-				break;
+	if (order > PMM_MAX_ORDER)
+		return NULL;
 
-			if (pages[page].flags & PAGE_FLAGS_FREE) {
-				++found;
-			} else
-				found = 0;
+	page_t *page = NULL;
+	bool drained = false;
+	for (;;) {
+		MUTEX_ACQUIRE(&freelistmutex, false);
+		for (int i = section; i >= 0 && page == NULL; --i)
+			page = buddyalloc(i, order);
 
-			if (found == size)
-				goto gotpages;
+		if (page) {
+			// give back the part of the block past the requested size
+			uintmax_t pageid = PAGE_GETID(page);
+			freerange(pageid + size, pageid + ((uintmax_t)1 << order));
+			MUTEX_RELEASE(&freelistmutex);
+			break;
 		}
-		found = 0;
-	}
+		MUTEX_RELEASE(&freelistmutex);
+
+		// no free block big enough. first get back the pages sitting in the cpu caches,
+		// then have the shrinkers (page cache included) free some memory and try again
+		if (noreclaim)
+			return NULL;
 
-	gotpages:
-	void *addr = NULL;
-	if (found == size) {
-		page = page - (found - 1);
-		addr = (void *)(page * PAGE_SIZE);
-		for (int i = 0; i < size; ++i) {
-			removefromfreelist(&pages[page + i]);
-			doalloc(&pages[page + i]);
+		if (drained == false) {
+			drained = true;
+			drainallcpus();
+			drainzeroed();
+			continue;
 		}
+
+		if (shrinker_run(SHRINK_BATCH) == 0)
+			return NULL;
+
+		drained = false;
 	}
 
-	MUTEX_RELEASE(&freelistmutex);
-	return addr;
+	for (uintmax_t i = 0; i < size; ++i)
+		doalloc(&page[i]);
+
+	void *address = pmm_getpageaddress(page);
+	if (zero)
+		memset(MAKE_HHDM(address), 0, size * PAGE_SIZE);
+
+	return address;
 }
 
 void pmm_free(void *addr, size_t size) {
@@ -0,0 +1,64 @@
+#include <kernel/shrinker.h>
+#include <kernel/scheduler.h>
+#include <arch/cpu.h>
+#include <mutex.h>
+#include <logging.h>
+
+static mutex_t mutex;
+static shrinker_t *shrinkers;
+static thread_t *shrinkingthread;
+
+void shrinker_register(shrinker_t *shrinker) {
+	__assert(shrinker->count && shrinker->scan);
+	MUTEX_ACQUIRE(&mutex, false);
+	// keep registration order, the first shrinkers are the cheapest to run
+	shrinker_t **iterator = &shrinkers;
+	while (*iterator)
+		iterator = &(*iterator)->next;
+
+	shrinker->next = NULL;
+	*iterator = shrinker;
+	MUTEX_RELEASE(&mutex);
+}
+
+void shrinker_unregister(shrinker_t *shrinker) {
+	MUTEX_ACQUIRE(&mutex, false);
+	shrinker_t **iterator = &shrinkers;
+	while (*iterator && *iterator != shrinker)
+		iterator = &(*iterator)->next;
+
+	__assert(*iterator);
+	*iterator = shrinker->next;
+	MUTEX_RELEASE(&mutex);
+}
+
+// asks the registered shrinkers for up to target pages back. returns how many pages were freed
+size_t shrinker_run(size_t target) {
+	thread_t *thread = _cpu()->thread;
+	// a shrinker may end up allocating memory while freeing some. if that allocation fails too, don't recurse into them
+	if (thread == NULL || thread == shrinkingthread)
+		return 0;
+
+	MUTEX_ACQUIRE(&mutex, false);
+	shrinkingthread = thread;
+
+	size_t freed = 0;
+	for (shrinker_t *shrinker = shrinkers; shrinker && freed < target; shrinker = shrinker->next) {
+		size_t count = shrinker->count(shrinker);
+		if (count == 0)
+			continue;
+
+		if (count > target - freed)
+			count = target - freed;
+
+		freed += shrinker->scan(shrinker, count);
+	}
+
+	shrinkingthread = NULL;
+	MUTEX_RELEASE(&mutex);
+	return freed;
+}
+
+void shrinker_init() {
+	MUTEX_INIT(&mutex);
+}
@@ -2,6 +2,9 @@
 #include <kernel/vmm.h>
 #include <logging.h>
 #include <util.h>
+#include <kernel/pmm.h>
+#include <arch/cpu.h>
+#include <kernel/shrinker.h>
 
 #define SLAB_INDIRECT_CUTOFF 512
 #define SLAB_INDIRECT_COUNT 16
@@ -14,6 +17,9 @@
 
 #define SLAB_DEBUG 0
 
+#define SLAB_MAGAZINE_MAXROUNDS 15
+#define SLAB_MAGAZINE_SIZE (sizeof(slabmagazine_t) + SLAB_MAGAZINE_MAXROUNDS * sizeof(void *))
+
 // the cache responsible for allocating all others
 static bool selfcacheinit = false;
 static scache_t selfcache = {
@@ -23,6 +29,14 @@ static scache_t selfcache = {
 	.slabobjcount = SLAB_DATA_SIZE / ROUND_UP(sizeof(scache_t) + sizeof(void **), 8)
 };
 
+// magazines are allocated from here. this cache (and selfcache) have no magazine layer themselves
+static scache_t *magcache;
+
+// every cache, walked by the shrinker
+static mutex_t cachelistmutex;
+static scache_t *cachelist;
+static shrinker_t slabshrinker;
+
 static void initdirect(scache_t *cache, slab_t *slab, void *base) {
 	slab->free = NULL;
 	slab->used = 0;
@@ -67,6 +81,13 @@ static bool growcache(scache_t *cache) {
 			return false;
 		}
 		initindirect(cache, slab, _slab, base);
+
+		// tag the object pages so the slab can be found from an object in constant time
+		for (uintptr_t offset = 0; offset < cache->slabobjcount * cache->truesize; offset += PAGE_SIZE) {
+			void *physical = arch_mmu_getphysical(_cpu()->vmmctx->pagetable, (void *)((uintptr_t)base + offset));
+			__assert(physical);
+			pmm_getpage(physical)->slab = slab;
+		}
 	}
 
 
@@ -75,6 +96,7 @@ static bool growcache(scache_t *cache) {
 	if (slab->next)
 		slab->next->prev = slab;
 	cache->empty = slab;
+	++cache->emptycount;
 	return true;
 }
 
@@ -113,28 +135,15 @@ static slab_t *returnobject(scache_t *cache, void *obj) {
 		freeptr = (void **)((uintptr_t)obj + cache->size);
 		__assert(*freeptr == NULL);
 	} else {
-		bool partial = cache->full == NULL;
-		slab = partial ? cache->partial : cache->full;
-		while (slab) {
-			void *top = (void *)((uintptr_t)slab->base + cache->slabobjcount * cache->truesize);
-			if (obj >= slab->base && obj < top)
-				break;
-			if (slab->next == NULL && partial == false) {
-				slab = cache->partial;
-				partial = true;
-			} else {
-				slab = slab->next;
-			}
-		}
+		void *physical = arch_mmu_getphysical(_cpu()->vmmctx->pagetable, obj);
+		__assert(physical);
+		slab = pmm_getpage(physical)->slab;
 		__assert(slab);
 		uintmax_t objn = ((uintptr_t)obj - (uintptr_t)slab->base) / cache->truesize;
 		void **base = (void **)ROUND_DOWN((uintptr_t)slab, PAGE_SIZE);
 		freeptr = &base[objn];
 	}
 
-	if (cache->dtor)
-		cache->dtor(cache, obj);
-
 	*freeptr = slab->free;
 	slab->free = freeptr;
 	--slab->used;
@@ -142,8 +151,8 @@ static slab_t *returnobject(scache_t *cache, void *obj) {
 	return slab;
 }
 
-void *slab_allocate(scache_t *cache) {
-	MUTEX_ACQUIRE(&cache->mutex, false);
+// expects cache->mutex to be held
+static void *allocatelocked(scache_t *cache) {
 	slab_t *slab = NULL;
 	if (cache->partial != NULL)
 		slab = cache->partial;
@@ -156,13 +165,14 @@ void *slab_allocate(scache_t *cache) {
 		if (growcache(cache))
 			slab = cache->empty;
 		else
-			goto cleanup;
+			return NULL;
 	}
 
 	ret = takeobject(cache, slab);
 
 	if (slab == cache->empty) {
 		cache->empty = slab->next;
+		--cache->emptycount;
 		if (slab->next)
 			slab->next->prev = NULL;
 
@@ -186,14 +196,11 @@ void *slab_allocate(scache_t *cache) {
 		cache->full = slab;
 	}
 
-	cleanup:
-	MUTEX_RELEASE(&cache->mutex);
 	return ret;
 }
 
-void slab_free(scache_t *cache, void *addr) {
-	MUTEX_ACQUIRE(&cache->mutex, false);
-
+// expects cache->mutex to be held
+static void freelocked(scache_t *cache, void *addr) {
 	slab_t *slab = returnobject(cache, addr);
 	__assert(slab);
 
@@ -211,6 +218,7 @@ void slab_free(scache_t *cache, void *addr) {
 		if (slab->next)
 			slab->next->prev = slab;
 		cache->empty = slab;
+		++cache->emptycount;
 	}
 	
 	if (slab->used == cache->slabobjcount - 1) {
@@ -228,19 +236,261 @@ void slab_free(scache_t *cache, void *addr) {
 			slab->next->prev = slab;
 		cache->partial = slab;
 	}
+}
+
+static void *slaballocate(scache_t *cache) {
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	void *ret = allocatelocked(cache);
 	MUTEX_RELEASE(&cache->mutex);
+	return ret;
 }
 
-scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *, void *), void (*dtor)(scache_t *, void *)) {
+static void slabfree(scache_t *cache, void *addr) {
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	freelocked(cache, addr);
+	MUTEX_RELEASE(&cache->mutex);
+}
+
+// the magazine layer sits in front of the slab layer. each cpu has a loaded and a previous magazine
+// it allocates from and frees to without touching any shared state. when both are unusable, a magazine
+// is exchanged with the depot, and only when the depot can't help the slab layer (and its mutex) is used.
+// all of the cpu functions expect interrupts to be disabled.
+
+static void depotpush(slabmagazine_t **list, size_t *count, slabmagazine_t *magazine) {
+	magazine->next = *list;
+	*list = magazine;
+	++*count;
+}
+
+static slabmagazine_t *depotpop(slabmagazine_t **list, size_t *count) {
+	slabmagazine_t *magazine = *list;
+	if (magazine) {
+		*list = magazine->next;
+		magazine->next = NULL;
+		--*count;
+	}
+	return magazine;
+}
+
+static void *cpuallocate(scache_t *cache) {
+	slabcpu_t *cpu = &cache->cpu[_cpu()->number];
+	void *obj = NULL;
+	spinlock_acquire(&cpu->lock);
+
+	if (cpu->loaded == NULL || cpu->loaded->rounds == 0) {
+		if (cpu->previous && cpu->previous->rounds > 0) {
+			slabmagazine_t *tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+		} else {
+			// trade the previous (empty) magazine for a full one from the depot
+			spinlock_acquire(&cache->depotlock);
+			slabmagazine_t *full = depotpop(&cache->depotfull, &cache->depotfullcount);
+			if (full) {
+				++cache->depothits;
+				if (cpu->previous)
+					depotpush(&cache->depotempty, &cache->depotemptycount, cpu->previous);
+
+				cpu->previous = cpu->loaded;
+				cpu->loaded = full;
+			} else {
+				++cache->depotmisses;
+			}
+			spinlock_release(&cache->depotlock);
+		}
+	}
+
+	if (cpu->loaded && cpu->loaded->rounds > 0) {
+		obj = cpu->loaded->objects[--cpu->loaded->rounds];
+		++cpu->hits;
+	} else {
+		++cpu->misses;
+	}
+
+	spinlock_release(&cpu->lock);
+	return obj;
+}
+
+// returns false if there was no room for the object in the cpu magazines
+static bool cpufree(scache_t *cache, void *obj) {
+	slabcpu_t *cpu = &cache->cpu[_cpu()->number];
+	bool done = false;
+	spinlock_acquire(&cpu->lock);
+
+	if (cpu->loaded == NULL || cpu->loaded->rounds == cache->magsize) {
+		if (cpu->previous && cpu->previous->rounds < cache->magsize) {
+			slabmagazine_t *tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+		} else {
+			// trade the previous (full) magazine for an empty one from the depot
+			spinlock_acquire(&cache->depotlock);
+			slabmagazine_t *empty = depotpop(&cache->depotempty, &cache->depotemptycount);
+			if (empty) {
+				++cache->depothits;
+				if (cpu->previous)
+					depotpush(&cache->depotfull, &cache->depotfullcount, cpu->previous);
+
+				cpu->previous = cpu->loaded;
+				cpu->loaded = empty;
+			} else {
+				++cache->depotmisses;
+			}
+			spinlock_release(&cache->depotlock);
+		}
+	}
+
+	if (cpu->loaded && cpu->loaded->rounds < cache->magsize) {
+		cpu->loaded->objects[cpu->loaded->rounds++] = obj;
+		++cpu->hits;
+		done = true;
+	} else {
+		++cpu->misses;
+	}
+
+	spinlock_release(&cpu->lock);
+	return done;
+}
+
+void *slab_allocate(scache_t *cache) {
+	if (cache->cpu) {
+		bool intstatus = interrupt_set(false);
+		void *obj = cpuallocate(cache);
+		interrupt_set(intstatus);
+		if (obj)
+			return obj;
+	}
+
+	return slaballocate(cache);
+}
+
+void slab_free(scache_t *cache, void *addr) {
+	if (cache->dtor)
+		cache->dtor(cache, addr);
+
+	if (cache->cpu) {
+		bool intstatus = interrupt_set(false);
+		bool done = cpufree(cache, addr);
+		interrupt_set(intstatus);
+		if (done)
+			return;
+
+		// the depot ran out of empty magazines, give it a new one and try again
+		slabmagazine_t *magazine = slaballocate(magcache);
+		if (magazine) {
+			magazine->rounds = 0;
+			intstatus = interrupt_set(false);
+			spinlock_acquire(&cache->depotlock);
+			depotpush(&cache->depotempty, &cache->depotemptycount, magazine);
+			spinlock_release(&cache->depotlock);
+			done = cpufree(cache, addr);
+			interrupt_set(intstatus);
+			if (done)
+				return;
+		}
+	}
+
+	slabfree(cache, addr);
+}
+
+// returns every object held in the magazine layer to the slab layer and frees the magazines
+static void flushmagazines(scache_t *cache) {
+	slabmagazine_t *list = NULL;
+	size_t count = 0;
+
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+		slabcpu_t *cpu = &cache->cpu[i];
+		bool intstatus = interrupt_set(false);
+		spinlock_acquire(&cpu->lock);
+		if (cpu->loaded)
+			depotpush(&list, &count, cpu->loaded);
+		if (cpu->previous)
+			depotpush(&list, &count, cpu->previous);
+		cpu->loaded = NULL;
+		cpu->previous = NULL;
+		spinlock_release(&cpu->lock);
+		interrupt_set(intstatus);
+	}
+
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&cache->depotlock);
+	slabmagazine_t *magazine;
+	while ((magazine = depotpop(&cache->depotfull, &cache->depotfullcount)))
+		depotpush(&list, &count, magazine);
+	while ((magazine = depotpop(&cache->depotempty, &cache->depotemptycount)))
+		depotpush(&list, &count, magazine);
+	spinlock_release(&cache->depotlock);
+	interrupt_set(intstatus);
+
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	for (magazine = list; magazine; magazine = magazine->next) {
+		while (magazine->rounds)
+			freelocked(cache, magazine->objects[--magazine->rounds]);
+	}
+	MUTEX_RELEASE(&cache->mutex);
+
+	while ((magazine = depotpop(&list, &count)))
+		slabfree(magcache, magazine);
+}
+
+void slab_getstats(scache_t *cache, slabstats_t *stats) {
+	memset(stats, 0, sizeof(slabstats_t));
+	if (cache->cpu == NULL)
+		return;
+
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+		stats->cpuhits += cache->cpu[i].hits;
+		stats->cpumisses += cache->cpu[i].misses;
+	}
+
+	stats->depothits = cache->depothits;
+	stats->depotmisses = cache->depotmisses;
+	stats->depotfull = cache->depotfullcount;
+	stats->depotempty = cache->depotemptycount;
+}
+
+// formats the stats of the caches with magazines, one line each. like snprintf, the text is cut at size
+// and the length of the whole of it is returned
+size_t slab_printstats(char *buffer, size_t size) {
+	size_t length = 0;
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	for (scache_t *cache = cachelist; cache; cache = cache->next) {
+		if (cache->cpu == NULL)
+			continue;
+
+		slabstats_t stats;
+		slab_getstats(cache, &stats);
+		length += snprintf(length < size ? buffer + length : NULL, length < size ? size - length : 0,
+			"size %lu: cpu %lu hits %lu misses, depot %lu hits %lu misses, %lu full %lu empty magazines\n",
+			cache->size, stats.cpuhits, stats.cpumisses, stats.depothits, stats.depotmisses, stats.depotfull, stats.depotempty);
+	}
+	MUTEX_RELEASE(&cachelistmutex);
+	return length;
+}
+
+// large objects get smaller magazines so idle cpus don't hoard too much memory
+static size_t magazinesize(size_t size) {
+	if (size < SLAB_INDIRECT_CUTOFF)
+		return SLAB_MAGAZINE_MAXROUNDS;
+	else if (size < PAGE_SIZE)
+		return 7;
+	else
+		return 3;
+}
+
+static scache_t *newcache(size_t size, size_t alignment, void (*ctor)(scache_t *, void *), void (*dtor)(scache_t *, void *), bool magazines) {
 	if (alignment == 0)
 		alignment = 8;
 
 	if (selfcacheinit == false) {
 		selfcacheinit = true;
 		MUTEX_INIT(&selfcache.mutex);
+		MUTEX_INIT(&cachelistmutex);
+		cachelist = &selfcache;
+		shrinker_register(&slabshrinker);
 	}
 
-	scache_t *cache = slab_allocate(&selfcache);
+	scache_t *cache = slaballocate(&selfcache);
 	if (cache == NULL)
 		return NULL;
 
@@ -254,41 +504,171 @@ scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *,
 	cache->full = NULL;
 	cache->empty = NULL;
 	cache->partial = NULL;
+	cache->emptycount = 0;
+	cache->cpu = NULL;
+	cache->magsize = magazinesize(size);
+	cache->depotfull = NULL;
+	cache->depotempty = NULL;
+	cache->depotfullcount = 0;
+	cache->depotemptycount = 0;
+	cache->depothits = 0;
+	cache->depotmisses = 0;
+	SPINLOCK_INIT(cache->depotlock);
 	MUTEX_INIT(&cache->mutex);
 
+	if (magazines) {
+		// the per-cpu structures are taken directly from the hhdm
+		__assert(sizeof(slabcpu_t) * ARCH_MAX_CPUS <= PAGE_SIZE);
+		void *cpupage = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
+		if (cpupage == NULL) {
+			slabfree(&selfcache, cache);
+			return NULL;
+		}
+
+		cache->cpu = MAKE_HHDM(cpupage);
+	}
+
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	cache->prev = NULL;
+	cache->next = cachelist;
+	cachelist->prev = cache;
+	cachelist = cache;
+	MUTEX_RELEASE(&cachelistmutex);
+
 	printf("slab: new cache: size %lu align %lu truesize %lu objcount %lu\n", cache->size, cache->alignment, cache->truesize, cache->slabobjcount);
 
 	return cache;
 }
 
-static size_t purge(scache_t *cache, size_t maxcount){
-	slab_t *slab = cache->empty;
-	for (size_t done = 0; done < maxcount; ++done) {
-		if (slab == NULL)
-			return done;
+scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *, void *), void (*dtor)(scache_t *, void *)) {
+	if (magcache == NULL) {
+		magcache = newcache(SLAB_MAGAZINE_SIZE, 0, NULL, NULL, false);
+		if (magcache == NULL)
+			return NULL;
+	}
+
+	return newcache(size, alignment, ctor, dtor, true);
+}
 
+// frees up to maxcount empty slabs, expects cache->mutex to be held. unmapflags are passed on to vmm_unmap.
+// unmapping fails if a range has to be split and there is no memory for it, which is likely when called
+// from the shrinker. the slab is then left on the empty list and purging stops
+static size_t purge(scache_t *cache, size_t maxcount, int unmapflags) {
+	size_t done = 0;
+	bool indirect = cache->size >= SLAB_INDIRECT_CUTOFF;
+	while (done < maxcount && cache->empty) {
+		slab_t *slab = cache->empty;
 		slab_t *next = slab->next;
+		if (indirect ? vmm_unmap(slab->base, cache->slabobjcount * cache->truesize, unmapflags) : vmm_unmap(slab, PAGE_SIZE, unmapflags))
+			break;
+
+		cache->empty = next;
 		if (next)
 			next->prev = NULL;
+		--cache->emptycount;
 
-		if (cache->size >= SLAB_INDIRECT_CUTOFF)
-			vmm_unmap(slab->base, cache->slabobjcount * cache->truesize, 0);
+		// the objects are already gone at this point, so if the header page can't be unmapped it is leaked
+		if (indirect && vmm_unmap(slab, PAGE_SIZE, unmapflags))
+			printf("slab: out of memory to unmap slab header %p, leaking it\n", slab);
 
-		vmm_unmap(slab, PAGE_SIZE, 0);
-
-		slab = cache->empty;
-		cache->empty = next;
+		++done;
 	}
 
-	return maxcount;
+	return done;
 }
 
 void slab_freecache(scache_t *cache) {
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		cachelist = cache->next;
+
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	MUTEX_RELEASE(&cachelistmutex);
+
+	if (cache->cpu)
+		flushmagazines(cache);
+
 	MUTEX_ACQUIRE(&cache->mutex, false);
 	__assert(cache->partial == NULL);
 	__assert(cache->full == NULL);
 
-	purge(cache, (size_t)-1);
+	purge(cache, (size_t)-1, 0);
+
+	if (cache->cpu)
+		pmm_release(FROM_HHDM(cache->cpu));
 
-	slab_free(&selfcache, cache);
+	slabfree(&selfcache, cache);
 }
+
+static inline size_t slabpages(scache_t *cache) {
+	if (cache->size < SLAB_INDIRECT_CUTOFF)
+		return 1;
+
+	return 1 + ROUND_UP(cache->slabobjcount * cache->truesize, PAGE_SIZE) / PAGE_SIZE;
+}
+
+static size_t shrinkercount(shrinker_t *shrinker) {
+	size_t count = 0;
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	for (scache_t *cache = cachelist; cache; cache = cache->next) {
+		count += cache->emptycount * slabpages(cache);
+		// objects sitting in the depot might be holding entire slabs
+		count += cache->depotfullcount * cache->magsize * cache->truesize / PAGE_SIZE;
+	}
+	MUTEX_RELEASE(&cachelistmutex);
+	return count;
+}
+
+// the shrinker can be called from an allocation made with a cache mutex held (growcache for example),
+// so busy caches are skipped instead of waited on. the per-cpu magazines are left alone, but the full
+// magazines in the depot are emptied into the slab layer first so the slabs they pin can be freed.
+// the magazines themselves go back to the depot, as freeing them would mean taking the magcache mutex.
+// for the same reason, nothing is done if the kernel address space can't be locked right away
+static size_t shrinkerscan(shrinker_t *shrinker, size_t count) {
+	if (vmm_trylockkernel() == false)
+		return 0;
+
+	size_t freed = 0;
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	for (scache_t *cache = cachelist; cache && freed < count; cache = cache->next) {
+		if (MUTEX_TRY(&cache->mutex) == false)
+			continue;
+
+		if (cache->cpu) {
+			for (;;) {
+				bool intstatus = interrupt_set(false);
+				spinlock_acquire(&cache->depotlock);
+				slabmagazine_t *magazine = depotpop(&cache->depotfull, &cache->depotfullcount);
+				spinlock_release(&cache->depotlock);
+				interrupt_set(intstatus);
+
+				if (magazine == NULL)
+					break;
+
+				while (magazine->rounds)
+					freelocked(cache, magazine->objects[--magazine->rounds]);
+
+				intstatus = interrupt_set(false);
+				spinlock_acquire(&cache->depotlock);
+				depotpush(&cache->depotempty, &cache->depotemptycount, magazine);
+				spinlock_release(&cache->depotlock);
+				interrupt_set(intstatus);
+			}
+		}
+
+		size_t pages = slabpages(cache);
+		freed += purge(cache, ROUND_UP(count - freed, pages) / pages, VMM_FLAGS_LOCKED) * pages;
+		MUTEX_RELEASE(&cache->mutex);
+	}
+	MUTEX_RELEASE(&cachelistmutex);
+	vmm_unlockkernel();
+	return freed;
+}
+
+static shrinker_t slabshrinker = {
+	.count = shrinkercount,
+	.scan = shrinkerscan
+};
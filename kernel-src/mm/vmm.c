@@ -7,6 +7,8 @@
 #include <string.h>
 #include <kernel/slab.h>
 #include <kernel/vmmcache.h>
+#include <kernel/scheduler.h>
+#include <errno.h>
 
 #define RANGE_TOP(x) (void *)((uintptr_t)x->start + x->size)
 
@@ -95,48 +97,495 @@ static vmmspace_t *getspace(void *vaddr) {
 }
 
 
+// the context a space is in. kernel space is NULL, as it is the same in every page table
+static vmmcontext_t *spacecontext(vmmspace_t *space) {
+	return space == &kernelspace ? NULL : (vmmcontext_t *)((uintptr_t)space - offsetof(vmmcontext_t, space));
+}
+
+static pagetableptr_t spacetable(vmmspace_t *space) {
+	vmmcontext_t *context = spacecontext(space);
+	return context ? context->pagetable : _cpu()->vmmctx->pagetable;
+}
+
+// reverse mapping of page cache pages. every range mapping a cacheable vnode is in the mappings list of the
+// vnode, so the mappings of a page can be found from its backing vnode and offset, and the vnodes with
+// any mappings are in a list for reclaim to go through. the lock order is space lock -> mappingslock -> mappedlock.
+// code going from the vnode side to the spaces only try to get their locks, since it already holds mappingslock
+static mutex_t mappedlock;
+static vnode_t *mappedhead;
+static vnode_t *mappedtail;
+static size_t mappedcount;
+
+static inline bool isrmapped(vmmrange_t *range) {
+	return (range->flags & VMM_FLAGS_FILE) && (range->vnode->type == V_TYPE_REGULAR || range->vnode->type == V_TYPE_BLKDEV);
+}
+
+// assumes mappedlock is held
+static void mappedinsert(vnode_t *vnode) {
+	vnode->mappednext = NULL;
+	vnode->mappedprev = mappedtail;
+	if (mappedtail)
+		mappedtail->mappednext = vnode;
+	else
+		mappedhead = vnode;
+
+	mappedtail = vnode;
+	++mappedcount;
+}
+
+// assumes mappedlock is held
+static void mappedremove(vnode_t *vnode) {
+	if (vnode->mappednext)
+		vnode->mappednext->mappedprev = vnode->mappedprev;
+	else
+		mappedtail = vnode->mappedprev;
+
+	if (vnode->mappedprev)
+		vnode->mappedprev->mappednext = vnode->mappednext;
+	else
+		mappedhead = vnode->mappednext;
+
+	--mappedcount;
+}
+
+static void rmapadd(vmmrange_t *range) {
+	vnode_t *vnode = range->vnode;
+	MUTEX_ACQUIRE(&vnode->mappingslock, false);
+	range->vnodeprev = NULL;
+	range->vnodenext = vnode->mappings;
+	if (vnode->mappings) {
+		vnode->mappings->vnodeprev = range;
+	} else {
+		MUTEX_ACQUIRE(&mappedlock, false);
+		mappedinsert(vnode);
+		MUTEX_RELEASE(&mappedlock);
+	}
+
+	vnode->mappings = range;
+	MUTEX_RELEASE(&vnode->mappingslock);
+}
+
+// has to be done before the range drops its reference to the vnode
+static void rmapremove(vmmrange_t *range) {
+	vnode_t *vnode = range->vnode;
+	MUTEX_ACQUIRE(&vnode->mappingslock, false);
+	if (range->vnodenext)
+		range->vnodenext->vnodeprev = range->vnodeprev;
+
+	if (range->vnodeprev) {
+		range->vnodeprev->vnodenext = range->vnodenext;
+	} else {
+		vnode->mappings = range->vnodenext;
+		if (vnode->mappings == NULL) {
+			MUTEX_ACQUIRE(&mappedlock, false);
+			mappedremove(vnode);
+			MUTEX_RELEASE(&mappedlock);
+		}
+	}
+
+	MUTEX_RELEASE(&vnode->mappingslock);
+}
+
+static bool trylockspace(vmmspace_t *space) {
+	if (MUTEX_TRY(&space->pflock) == false)
+		return false;
+
+	if (MUTEX_TRY(&space->lock) == false) {
+		MUTEX_RELEASE(&space->pflock);
+		return false;
+	}
+
+	return true;
+}
+
+static void unlockspace(vmmspace_t *space) {
+	MUTEX_RELEASE(&space->lock);
+	MUTEX_RELEASE(&space->pflock);
+}
+
+// ranges are kept both in an address ordered list, for walking them in order, and in a red-black tree
+// keyed by their start address, for lookups. every tree node also holds the size of the free gap between
+// it and the previous range, and the biggest such gap in its subtree, so free space can be found quickly.
+
+static inline size_t maxgap(vmmrange_t *range) {
+	return range ? range->maxgap : 0;
+}
+
+// recomputes the biggest gap of a node from its children
+static void augment(vmmrange_t *range) {
+	size_t gap = range->gap;
+	if (maxgap(range->left) > gap)
+		gap = maxgap(range->left);
+	if (maxgap(range->right) > gap)
+		gap = maxgap(range->right);
+	range->maxgap = gap;
+}
+
+static void propagate(vmmrange_t *range) {
+	while (range) {
+		augment(range);
+		range = range->parent;
+	}
+}
+
+// sets the gap of a range after its start or the top of the previous range changed
+static void updategap(vmmspace_t *space, vmmrange_t *range) {
+	if (range == NULL)
+		return;
+
+	void *prevtop = range->prev ? RANGE_TOP(range->prev) : space->start;
+	range->gap = (uintptr_t)range->start - (uintptr_t)prevtop;
+	propagate(range);
+}
+
+static void rotateleft(vmmspace_t *space, vmmrange_t *range) {
+	vmmrange_t *child = range->right;
+	range->right = child->left;
+	if (child->left)
+		child->left->parent = range;
+
+	child->parent = range->parent;
+	if (range->parent == NULL)
+		space->root = child;
+	else if (range == range->parent->left)
+		range->parent->left = child;
+	else
+		range->parent->right = child;
+
+	child->left = range;
+	range->parent = child;
+	augment(range);
+	augment(child);
+}
+
+static void rotateright(vmmspace_t *space, vmmrange_t *range) {
+	vmmrange_t *child = range->left;
+	range->left = child->right;
+	if (child->right)
+		child->right->parent = range;
+
+	child->parent = range->parent;
+	if (range->parent == NULL)
+		space->root = child;
+	else if (range == range->parent->right)
+		range->parent->right = child;
+	else
+		range->parent->left = child;
+
+	child->right = range;
+	range->parent = child;
+	augment(range);
+	augment(child);
+}
+
+static inline bool isred(vmmrange_t *range) {
+	return range && range->red;
+}
+
+static void treeinsert(vmmspace_t *space, vmmrange_t *newrange) {
+	vmmrange_t *parent = NULL;
+	vmmrange_t **link = &space->root;
+	while (*link) {
+		parent = *link;
+		link = newrange->start < parent->start ? &parent->left : &parent->right;
+	}
+
+	newrange->parent = parent;
+	newrange->left = NULL;
+	newrange->right = NULL;
+	newrange->red = true;
+	*link = newrange;
+	propagate(newrange);
+
+	// rotations keep the set of nodes under the rotated subtree, so only the rotated nodes need augmenting
+	vmmrange_t *range = newrange;
+	while (isred(range->parent)) {
+		vmmrange_t *parent = range->parent;
+		vmmrange_t *grandparent = parent->parent;
+		if (parent == grandparent->left) {
+			vmmrange_t *uncle = grandparent->right;
+			if (isred(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				range = grandparent;
+				continue;
+			}
+
+			if (range == parent->right) {
+				range = parent;
+				rotateleft(space, range);
+				parent = range->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rotateright(space, grandparent);
+		} else {
+			vmmrange_t *uncle = grandparent->left;
+			if (isred(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				range = grandparent;
+				continue;
+			}
+
+			if (range == parent->left) {
+				range = parent;
+				rotateright(space, range);
+				parent = range->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			rotateleft(space, grandparent);
+		}
+	}
+
+	space->root->red = false;
+}
+
+static void transplant(vmmspace_t *space, vmmrange_t *old, vmmrange_t *new) {
+	if (old->parent == NULL)
+		space->root = new;
+	else if (old == old->parent->left)
+		old->parent->left = new;
+	else
+		old->parent->right = new;
+
+	if (new)
+		new->parent = old->parent;
+}
+
+static void treeremove(vmmspace_t *space, vmmrange_t *range) {
+	vmmrange_t *child;
+	vmmrange_t *parent;
+	bool removedred = range->red;
+
+	if (range->left == NULL) {
+		child = range->right;
+		parent = range->parent;
+		transplant(space, range, range->right);
+	} else if (range->right == NULL) {
+		child = range->left;
+		parent = range->parent;
+		transplant(space, range, range->left);
+	} else {
+		// replace it with its successor
+		vmmrange_t *successor = range->right;
+		while (successor->left)
+			successor = successor->left;
+
+		removedred = successor->red;
+		child = successor->right;
+		if (successor->parent == range) {
+			parent = successor;
+		} else {
+			parent = successor->parent;
+			transplant(space, successor, successor->right);
+			successor->right = range->right;
+			successor->right->parent = successor;
+		}
+
+		transplant(space, range, successor);
+		successor->left = range->left;
+		successor->left->parent = successor;
+		successor->red = range->red;
+	}
+
+	// every node whose subtree changed is between parent and the root
+	propagate(parent);
+
+	if (removedred)
+		return;
+
+	while (child != space->root && isred(child) == false) {
+		if (child == parent->left) {
+			vmmrange_t *sibling = parent->right;
+			if (isred(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				rotateleft(space, parent);
+				sibling = parent->right;
+			}
+
+			if (isred(sibling->left) == false && isred(sibling->right) == false) {
+				sibling->red = true;
+				child = parent;
+				parent = child->parent;
+				continue;
+			}
+
+			if (isred(sibling->right) == false) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rotateright(space, sibling);
+				sibling = parent->right;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rotateleft(space, parent);
+			child = space->root;
+		} else {
+			vmmrange_t *sibling = parent->left;
+			if (isred(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				rotateright(space, parent);
+				sibling = parent->left;
+			}
+
+			if (isred(sibling->left) == false && isred(sibling->right) == false) {
+				sibling->red = true;
+				child = parent;
+				parent = child->parent;
+				continue;
+			}
+
+			if (isred(sibling->left) == false) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rotateleft(space, sibling);
+				sibling = parent->left;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rotateright(space, parent);
+			child = space->root;
+		}
+	}
+
+	if (child)
+		child->red = false;
+}
+
+// links a range in the list after prev (or as the first one if prev is NULL) and in the tree
+static void linkrange(vmmspace_t *space, vmmrange_t *prev, vmmrange_t *range) {
+	range->prev = prev;
+	range->next = prev ? prev->next : space->ranges;
+	if (prev)
+		prev->next = range;
+	else
+		space->ranges = range;
+
+	if (range->next)
+		range->next->prev = range;
+
+	void *prevtop = prev ? RANGE_TOP(prev) : space->start;
+	range->gap = (uintptr_t)range->start - (uintptr_t)prevtop;
+	treeinsert(space, range);
+	updategap(space, range->next);
+
+	range->space = space;
+	if (isrmapped(range))
+		rmapadd(range);
+}
+
+static void unlinkrange(vmmspace_t *space, vmmrange_t *range) {
+	if (range->prev)
+		range->prev->next = range->next;
+	else
+		space->ranges = range->next;
+
+	if (range->next)
+		range->next->prev = range->prev;
+
+	treeremove(space, range);
+	updategap(space, range->next);
+
+	if (isrmapped(range))
+		rmapremove(range);
+}
+
 // get a range from an address
 static vmmrange_t *getrange(vmmspace_t *space, void *addr) {
-	vmmrange_t *range = space->ranges;
+	vmmrange_t *range = space->root;
 	while (range) {
-		if (addr >= range->start && addr < RANGE_TOP(range))
+		if (addr < range->start)
+			range = range->left;
+		else if (addr >= RANGE_TOP(range))
+			range = range->right;
+		else
 			break;
-		range = range->next;
 	}
 	return range;
 }
 
-// get start of range that fits specific size from specific offset
-static void *getfreerange(vmmspace_t *space, void *addr, size_t size) {
-	vmmrange_t *range = space->ranges;
-	if (addr == NULL)
-		addr = space->start;
+// get the first range that ends after addr
+static vmmrange_t *getrangeafter(vmmspace_t *space, void *addr) {
+	vmmrange_t *range = space->root;
+	vmmrange_t *found = NULL;
+	while (range) {
+		if (RANGE_TOP(range) > addr) {
+			found = range;
+			range = range->left;
+		} else {
+			range = range->right;
+		}
+	}
+	return found;
+}
 
-	// if theres no ranges
-	if (range == NULL)
-		return addr;
+// get the last range that starts before addr
+static vmmrange_t *getrangebefore(vmmspace_t *space, void *addr) {
+	vmmrange_t *range = space->root;
+	vmmrange_t *found = NULL;
+	while (range) {
+		if (range->start < addr) {
+			found = range;
+			range = range->right;
+		} else {
+			range = range->left;
+		}
+	}
+	return found;
+}
 
-	// if theres free space before the first range
-	if (range->start != space->start && addr < range->start && (uintptr_t)range->start - (uintptr_t)addr >= size)
-		return addr;
+// get the first range in address order with a free gap of at least size before it, ignoring anything below addr
+static vmmrange_t *findgap(vmmrange_t *range, void *addr, size_t size) {
+	if (range == NULL || range->maxgap < size)
+		return NULL;
 
-	while (range->next) {
-		void *rangetop = RANGE_TOP(range);
-		if (addr < rangetop)
-			addr = rangetop;
+	// if this range starts below addr, so does everything in the left subtree
+	if (range->start > addr) {
+		vmmrange_t *found = findgap(range->left, addr, size);
+		if (found)
+			return found;
+	}
 
-		if (addr < range->next->start) {
-			size_t freesize = (uintptr_t)range->next->start - (uintptr_t)addr;
-			if (freesize >= size)
-				return addr;
-		}
-		range = range->next;
+	void *gapstart = (void *)((uintptr_t)range->start - range->gap);
+	if (gapstart < addr)
+		gapstart = addr;
+
+	if (gapstart < range->start && (uintptr_t)range->start - (uintptr_t)gapstart >= size)
+		return range;
+
+	return findgap(range->right, addr, size);
+}
+
+// get start of range that fits specific size from specific offset
+static void *getfreerange(vmmspace_t *space, void *addr, size_t size) {
+	if (addr == NULL || addr < space->start)
+		addr = space->start;
+
+	vmmrange_t *range = findgap(space->root, addr, size);
+	if (range) {
+		void *gapstart = (void *)((uintptr_t)range->start - range->gap);
+		return gapstart < addr ? addr : gapstart;
 	}
 
 	// if theres free space after the last range
-	void *rangetop = RANGE_TOP(range);
-	if (addr < rangetop)
-		addr = rangetop;
+	vmmrange_t *last = space->root;
+	while (last && last->right)
+		last = last->right;
+
+	if (last && addr < RANGE_TOP(last))
+		addr = RANGE_TOP(last);
 
 	if (addr != space->end && (uintptr_t)space->end - (uintptr_t)addr >= size)
 		return addr;
@@ -145,51 +594,17 @@ static void *getfreerange(vmmspace_t *space, void *addr, size_t size) {
 }
 
 static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
-	vmmrange_t *range = space->ranges;
-
-	// space has no other ranges
-	if (range == NULL) {
-		space->ranges = newrange;
-		newrange->next = NULL;
-		newrange->prev = NULL;
-		return;
-	}
-
+	linkrange(space, getrangebefore(space, newrange->start), newrange);
 	void *newrangetop = RANGE_TOP(newrange);
 
-	// range is before the first space range
-	if (newrangetop <= range->start) {
-		space->ranges = newrange;
-		newrange->next = range;
-		range->prev = newrange;
-		newrange->prev = NULL;
-		goto fragcheck;
-	}
-
-	while (range->next) {
-		if (newrange->start >= RANGE_TOP(range) && newrange->start < range->next->start) { // space inbetween two other ranges
-			newrange->next = range->next;
-			newrange->prev = range;
-			range->next = newrange;
-			goto fragcheck;
-		}
-		range = range->next;
-	}
-
-	// space after the second range
-	range->next = newrange;
-	newrange->prev = range;
-	newrange->next = NULL;
-
-	fragcheck:
 	// join new range and the next
 	if (newrange->next && newrange->next->start == newrangetop && newrange->flags == newrange->next->flags && newrange->mmuflags == newrange->next->mmuflags
 		&& ((newrange->flags & VMM_FLAGS_FILE) == 0 || (newrange->vnode == newrange->next->vnode && newrange->offset + newrange->size == newrange->next->offset))) {
 		vmmrange_t *oldrange = newrange->next;
+		unlinkrange(space, oldrange);
 		newrange->size += oldrange->size;
-		newrange->next = oldrange->next;
-		if (oldrange->next)
-			oldrange->next->prev = newrange;
+		// the unlink measured the gap after it from the old top
+		updategap(space, newrange->next);
 
 		freerange(oldrange);
 		if (newrange->flags & VMM_FLAGS_FILE) {
@@ -201,11 +616,9 @@ static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
 	if (newrange->prev && RANGE_TOP(newrange->prev) == newrange->start && newrange->flags == newrange->prev->flags && newrange->mmuflags == newrange->prev->mmuflags
 		&& ((newrange->flags & VMM_FLAGS_FILE) == 0 || (newrange->vnode == newrange->prev->vnode && newrange->prev->offset + newrange->prev->size == newrange->offset))) {
 		vmmrange_t *oldrange = newrange->prev;
+		unlinkrange(space, newrange);
 		oldrange->size += newrange->size;
-		oldrange->next = newrange->next;
-
-		if (newrange->next)
-			newrange->next->prev = oldrange;
+		updategap(space, oldrange->next);
 
 		freerange(newrange);
 		if (oldrange->flags & VMM_FLAGS_FILE) {
@@ -214,8 +627,25 @@ static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
 	}
 }
 
+// pages unmapped dirty are only marked as such after the flush, as other cpus can keep writing to them
+// through their tlb entries until then and the writes would be lost if the page was written back before it
+static void flushdirty(mmubatch_t *batch, void **dirty, size_t *dirtycount) {
+	arch_mmu_batchflush(batch);
+	for (size_t i = 0; i < *dirtycount; ++i) {
+		vmmcache_makedirty(pmm_getpage(dirty[i]));
+		pmm_release(dirty[i]);
+	}
+
+	*dirtycount = 0;
+}
+
 static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int flags) {
 	uintmax_t top = _offset + size;
+	// the pages are only released after the tlb entries are gone
+	mmubatch_t batch;
+	arch_mmu_batchinit(&batch);
+	void *dirty[ARCH_MMU_BATCH_PAGES];
+	size_t dirtycount = 0;
 
 	for (uintmax_t offset = _offset; offset < top; offset += PAGE_SIZE) {
 		void *vaddr = (void *)((uintptr_t)range->start + offset);
@@ -223,58 +653,98 @@ static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int
 		if (physical == NULL)
 			continue;
 
+		// huge pages (always anonymous) are freed whole if they are entirely unmapped, otherwise they are split
+		if (arch_mmu_ishuge(_cpu()->vmmctx->pagetable, vaddr)) {
+			if (((uintptr_t)vaddr & (ARCH_MMU_HUGEPAGE_SIZE - 1)) == 0 && offset + ARCH_MMU_HUGEPAGE_SIZE <= top) {
+				arch_mmu_unmapbatch(_cpu()->vmmctx->pagetable, vaddr, &batch);
+				arch_mmu_batchflush(&batch);
+				pmm_free(physical, ARCH_MMU_HUGEPAGE_SIZE / PAGE_SIZE);
+				offset += ARCH_MMU_HUGEPAGE_SIZE - PAGE_SIZE;
+				continue;
+			}
+
+			// unmap() already split the huge pages at the edges of the unmapped area
+			__assert(!"huge page partially unmapped");
+		}
+
 		thread_t *thread = _cpu()->thread;
 		proc_t *proc = thread ? thread->proc : NULL;
 		cred_t *cred = proc ? &proc->cred : NULL;
 
+		// page cache pages that were accessed through the mapping count as used for the page replacement
+		if ((range->flags & VMM_FLAGS_FILE) && range->vnode->type != V_TYPE_CHDEV && pmm_getpage(physical)->backing
+			&& arch_mmu_isaccessed(_cpu()->vmmctx->pagetable, vaddr))
+			pmm_markaccessed(pmm_getpage(physical));
+
 		if ((range->flags & VMM_FLAGS_FILE) && ((range->flags & VMM_FLAGS_SHARED) || range->vnode->type == V_TYPE_CHDEV)) {
 			// shared file mapping or character device mapping
 			if (range->vnode->type == V_TYPE_CHDEV) {
 				// character device mapping
 				__assert(VOP_MUNMAP(range->vnode, vaddr, range->offset + offset, mmuflagstovnodeflags(range->mmuflags) | (range->flags & VMM_FLAGS_SHARED ? V_FFLAGS_SHARED : 0), cred) == 0);
 			} else if (arch_mmu_iswritable(_cpu()->vmmctx->pagetable, vaddr) && arch_mmu_isdirty(_cpu()->vmmctx->pagetable, vaddr)) {
-				// dirty page cache mapping
-				arch_mmu_unmap(_cpu()->vmmctx->pagetable, vaddr);
-				vmmcache_makedirty(pmm_getpage(physical));
-				pmm_release(physical);
+				// dirty page cache mapping, the reference of the mapping is kept until it is marked
+				if (dirtycount == ARCH_MMU_BATCH_PAGES)
+					flushdirty(&batch, dirty, &dirtycount);
+
+				arch_mmu_unmapbatch(_cpu()->vmmctx->pagetable, vaddr, &batch);
+				dirty[dirtycount++] = physical;
 			} else {
 				// non dirty page mapping
-				arch_mmu_unmap(_cpu()->vmmctx->pagetable, vaddr);
-				pmm_release(physical);
+				arch_mmu_unmapbatch(_cpu()->vmmctx->pagetable, vaddr, &batch);
+				arch_mmu_batchrelease(&batch, physical);
 			}
 		} else {
 			// anonymous, physical or private non character device mapping
-			arch_mmu_unmap(_cpu()->vmmctx->pagetable, vaddr);
+			arch_mmu_unmapbatch(_cpu()->vmmctx->pagetable, vaddr, &batch);
 			if ((range->flags & VMM_FLAGS_PHYSICAL) == 0)
-				pmm_release(physical);
+				arch_mmu_batchrelease(&batch, physical);
 		}
 	}
 
+	flushdirty(&batch, dirty, &dirtycount);
+
 	if ((range->flags & VMM_FLAGS_FILE) && range->size == size)
 		VOP_RELEASE(range->vnode);
 }
 
-static void unmap(vmmspace_t *space, void *address, size_t size) {
+// splits the huge page at vaddr if it would be only partially unmapped
+static bool splitedge(void *vaddr) {
+	if (((uintptr_t)vaddr & (ARCH_MMU_HUGEPAGE_SIZE - 1)) == 0 || arch_mmu_ishuge(_cpu()->vmmctx->pagetable, vaddr) == false)
+		return true;
+
+	return arch_mmu_splithuge(_cpu()->vmmctx->pagetable, vaddr);
+}
+
+static int unmap(vmmspace_t *space, void *address, size_t size) {
 	void *top = (void *)((uintptr_t)address + size);
-	vmmrange_t *range = space->ranges;
-	while (range) {
-		__assert(range != space->ranges || range->prev == NULL);
+	vmmrange_t *range = getrangeafter(space, address);
+
+	// cutting a hole in a range needs a new range for the part after it and splitting a huge page needs
+	// a page table, so both are taken before anything is torn down. a split page maps the same memory,
+	// so the first split doesn't have to be undone if the second fails
+	vmmrange_t *new = NULL;
+	if (range && address > range->start && top < RANGE_TOP(range)) {
+		new = allocrange();
+		if (new == NULL)
+			return ENOMEM;
+	}
+
+	if (splitedge(address) == false || splitedge(top) == false) {
+		if (new)
+			freerange(new);
+		return ENOMEM;
+	}
+
+	while (range && range->start < top) {
+		vmmrange_t *next = range->next;
 		void *rangetop = RANGE_TOP(range);
 		// completely unmapped
 		if (range->start >= address && rangetop <= top) {
-			if (range->prev)
-				range->prev->next = range->next;
-			else
-				space->ranges = range->next;
-
-			if (range->next)
-				range->next->prev = range->prev;
-
+			unlinkrange(space, range);
 			destroyrange(range, 0, range->size, 0);
 			freerange(range);
 		} else if (address > range->start && top < rangetop) { // split
-			vmmrange_t *new = allocrange();
-			__assert(new); // XXX deal with this better
+			__assert(new);
 			*new = *range;
 
 			destroyrange(range, (uintptr_t)address - (uintptr_t)range->start, size, 0);
@@ -283,23 +753,18 @@ static void unmap(vmmspace_t *space, void *address, size_t size) {
 			new->size = (uintptr_t)rangetop - (uintptr_t)new->start;
 			range->size = (uintptr_t)address - (uintptr_t)range->start;
 
-			if (range->next)
-				range->next->prev = new;
-
-			// new->next is set by the copy in *new = *range
-			new->prev = range;
-			range->next = new;
-
 			if (range->flags & VMM_FLAGS_FILE) {
 				VOP_HOLD(range->vnode);
 				new->offset += range->size + size;
-
 			}
+
+			linkrange(space, range, new);
 		} else if (top > range->start && range->start >= address) { // partially unmap from start
 			size_t difference = (uintptr_t)top - (uintptr_t)range->start;
 			destroyrange(range, 0, difference, 0);
 			range->start = (void *)((uintptr_t)range->start + difference);
 			range->size -= difference;
+			updategap(space, range);
 
 			if (range->flags & VMM_FLAGS_FILE)
 				range->offset += difference;
@@ -307,11 +772,135 @@ static void unmap(vmmspace_t *space, void *address, size_t size) {
 			size_t difference = (uintptr_t)rangetop - (uintptr_t)address;
 			range->size -= difference;
 			destroyrange(range, range->size, difference, 0);
+			updategap(space, range->next);
 		}
 
-		range = range->next;
+		range = next;
+	}
+
+	return 0;
+}
+
+// unmaps up to count pages of the vnode that weren't accessed through a mapping since the last time it was looked at.
+// only read only mappings are touched, writable ones can have data that isn't in the dirty state of the page yet
+static size_t unmapcoldvnode(vnode_t *vnode, size_t count) {
+	size_t unmapped = 0;
+	MUTEX_ACQUIRE(&vnode->mappingslock, false);
+	for (vmmrange_t *range = vnode->mappings; range && unmapped < count; range = range->vnodenext) {
+		vmmspace_t *space = range->space;
+		if (trylockspace(space) == false)
+			continue;
+
+		pagetableptr_t table = spacetable(space);
+		mmubatch_t batch;
+		arch_mmu_batchinit(&batch);
+		batch.context = spacecontext(space);
+
+		for (uintmax_t offset = 0; offset < range->size && unmapped < count; offset += PAGE_SIZE) {
+			void *vaddr = (void *)((uintptr_t)range->start + offset);
+			void *physical = arch_mmu_getphysical(table, vaddr);
+			if (physical == NULL || arch_mmu_iswritable(table, vaddr))
+				continue;
+
+			// private mappings can have anonymous copies of the pages
+			page_t *page = pmm_getpage(physical);
+			if (page->backing != vnode || (page->flags & PAGE_FLAGS_PINNED))
+				continue;
+
+			if (arch_mmu_clearaccessed(table, vaddr)) {
+				pmm_markaccessed(page);
+				continue;
+			}
+
+			arch_mmu_unmapbatch(table, vaddr, &batch);
+			arch_mmu_batchrelease(&batch, physical);
+			++unmapped;
+		}
+
+		arch_mmu_batchflush(&batch);
+		unlockspace(space);
 	}
 
+	MUTEX_RELEASE(&vnode->mappingslock);
+	return unmapped;
+}
+
+// goes through the vnodes with mappings, starting from the one that was looked at the longest ago,
+// and unmaps up to count cold page cache pages. returns how many mappings were removed.
+// the pages end up in the standby lists once nothing else maps them
+size_t vmm_unmapcold(size_t count) {
+	size_t unmapped = 0;
+	MUTEX_ACQUIRE(&mappedlock, false);
+	size_t vnodecount = mappedcount;
+	MUTEX_RELEASE(&mappedlock);
+
+	for (size_t i = 0; i < vnodecount && unmapped < count; ++i) {
+		MUTEX_ACQUIRE(&mappedlock, false);
+		vnode_t *vnode = mappedhead;
+		if (vnode == NULL) {
+			MUTEX_RELEASE(&mappedlock);
+			break;
+		}
+
+		// a vnode on the list is held by its mappings
+		mappedremove(vnode);
+		mappedinsert(vnode);
+		VOP_HOLD(vnode);
+		MUTEX_RELEASE(&mappedlock);
+
+		unmapped += unmapcoldvnode(vnode, count - unmapped);
+		VOP_RELEASE(vnode);
+	}
+
+	return unmapped;
+}
+
+// removes the mappings of the pages of the vnode that were truncated off the cache, from offset onwards.
+// called after vmmcache_truncate without any vnode locks held, as the page fault handler can take them
+// with the space locks held. if a space is busy, everything is let go of and tried again
+void vmm_unmapvnode(vnode_t *vnode, uintmax_t offset) {
+	offset = ROUND_DOWN(offset, PAGE_SIZE);
+	if (vnode->type != V_TYPE_REGULAR && vnode->type != V_TYPE_BLKDEV)
+		return;
+
+	retry:
+	MUTEX_ACQUIRE(&vnode->mappingslock, false);
+	for (vmmrange_t *range = vnode->mappings; range; range = range->vnodenext) {
+		if (range->offset + range->size <= offset)
+			continue;
+
+		vmmspace_t *space = range->space;
+		if (trylockspace(space) == false) {
+			MUTEX_RELEASE(&vnode->mappingslock);
+			sched_yield();
+			goto retry;
+		}
+
+		pagetableptr_t table = spacetable(space);
+		mmubatch_t batch;
+		arch_mmu_batchinit(&batch);
+		batch.context = spacecontext(space);
+
+		uintmax_t start = range->offset < offset ? offset - range->offset : 0;
+		for (uintmax_t mapoffset = start; mapoffset < range->size; mapoffset += PAGE_SIZE) {
+			void *vaddr = (void *)((uintptr_t)range->start + mapoffset);
+			void *physical = arch_mmu_getphysical(table, vaddr);
+			if (physical == NULL)
+				continue;
+
+			page_t *page = pmm_getpage(physical);
+			if (page->backing != vnode || (page->flags & PAGE_FLAGS_TRUNCATED) == 0)
+				continue;
+
+			arch_mmu_unmapbatch(table, vaddr, &batch);
+			arch_mmu_batchrelease(&batch, physical);
+		}
+
+		arch_mmu_batchflush(&batch);
+		unlockspace(space);
+	}
+
+	MUTEX_RELEASE(&vnode->mappingslock);
 }
 
 static void printspace(vmmspace_t *space) {
@@ -325,6 +914,70 @@ static void printspace(vmmspace_t *space) {
 
 static void *zeropage;
 
+#define FAULTAROUND_PAGES 16
+
+// fault-around for file mappings. after a read fault, the pages in the same aligned window that are
+// already ready in the page cache are mapped read only too, so sequential accesses don't fault on every page.
+// nothing is read from the backing vnode here
+static void faultaround(vmmrange_t *range, void *addr) {
+	uintptr_t window = FAULTAROUND_PAGES * PAGE_SIZE;
+	void *start = (void *)ROUND_DOWN((uintptr_t)addr, window);
+	void *top = (void *)((uintptr_t)start + window);
+	if (start < range->start)
+		start = range->start;
+
+	if (top > RANGE_TOP(range))
+		top = RANGE_TOP(range);
+
+	for (void *vaddr = start; vaddr < top; vaddr = (void *)((uintptr_t)vaddr + PAGE_SIZE)) {
+		if (vaddr == addr || arch_mmu_ispresent(_cpu()->vmmctx->pagetable, vaddr))
+			continue;
+
+		page_t *page;
+		uintmax_t mapoffset = (uintptr_t)vaddr - (uintptr_t)range->start;
+		if (vmmcache_getresident(range->vnode, range->offset + mapoffset, &page))
+			continue;
+
+		if (arch_mmu_map(_cpu()->vmmctx->pagetable, pmm_getpageaddress(page), vaddr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false) {
+			pmm_release(pmm_getpageaddress(page));
+			break;
+		}
+
+		// same as in vmm_pagefault
+		if (page->flags & PAGE_FLAGS_TRUNCATED) {
+			arch_mmu_unmap(_cpu()->vmmctx->pagetable, vaddr);
+			pmm_release(pmm_getpageaddress(page));
+		}
+	}
+}
+
+// transparent huge pages. the first fault in a 2mb aligned region of private anonymous user memory gets
+// a whole zeroed huge page, as long as the range covers the region and nothing in it is mapped yet.
+// there is no huge zero page, so only writable ranges are eligible.
+// the 512 pages are still referenced one by one, so splitting the huge page back is just a page table change
+static bool maphuge(vmmspace_t *space, vmmrange_t *range, void *addr) {
+	void *base = (void *)ROUND_DOWN((uintptr_t)addr, ARCH_MMU_HUGEPAGE_SIZE);
+	void *top = (void *)((uintptr_t)base + ARCH_MMU_HUGEPAGE_SIZE);
+	if (space == &kernelspace || (range->flags & VMM_PERMANENT_FLAGS_MASK) || (range->mmuflags & ARCH_MMU_FLAGS_WRITE) == 0)
+		return false;
+
+	if (base < range->start || top > RANGE_TOP(range) || arch_mmu_canmaphuge(_cpu()->vmmctx->pagetable, base) == false)
+		return false;
+
+	// falling back to small pages is cheaper than reclaiming memory for a huge one
+	void *physical = pmm_alloc(ARCH_MMU_HUGEPAGE_SIZE / PAGE_SIZE, PMM_SECTION_DEFAULT | PMM_FLAGS_NORECLAIM);
+	if (physical == NULL)
+		return false;
+
+	memset(MAKE_HHDM(physical), 0, ARCH_MMU_HUGEPAGE_SIZE);
+	if (arch_mmu_maphuge(_cpu()->vmmctx->pagetable, physical, base, range->mmuflags) == false) {
+		pmm_free(physical, ARCH_MMU_HUGEPAGE_SIZE / PAGE_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
 bool vmm_pagefault(void *addr, bool user, int actions) {
 	if (user == false && addr > USERSPACE_END)
 		return false;
@@ -389,9 +1042,18 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 					if (!status) {
 						printf("vmm: out of memory to map file into address space\n");
 						pmm_release(pmm_getpageaddress(res));
+					} else if (res->flags & PAGE_FLAGS_TRUNCATED) {
+						// the file was truncated after the page was looked up, and vmm_unmapvnode could have
+						// gone through this space already. let the access fault again and see the new size
+						arch_mmu_unmap(_cpu()->vmmctx->pagetable, addr);
+						pmm_release(pmm_getpageaddress(res));
+					} else if ((actions & VMM_ACTION_WRITE) == 0) {
+						faultaround(range, addr);
 					}
 				}
 			}
+		} else if (maphuge(space, range, addr)) {
+			status = true;
 		} else {
 			// anonymous memory. map the zero'd page
 			status = arch_mmu_map(_cpu()->vmmctx->pagetable, zeropage, addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
@@ -410,14 +1072,20 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 				vmmcache_makedirty(pmm_getpage(oldphys));
 
 			status = true;
+		} else if (arch_mmu_ishuge(_cpu()->vmmctx->pagetable, addr) && arch_mmu_splithuge(_cpu()->vmmctx->pagetable, addr) == false) {
+			printf("vmm: out of memory to split huge page for copy on write\n");
+			status = false;
 		} else {
-			// do copy on write
-			void *newphys = pmm_allocpage(PMM_SECTION_DEFAULT);
+			// do copy on write. writes to the zero page just need a zeroed page, which is likely to be ready
+			bool fromzero = oldphys == zeropage;
+			void *newphys = pmm_allocpage(PMM_SECTION_DEFAULT | (fromzero ? PMM_FLAGS_ZERO : 0));
 			if (newphys == NULL) {
 				printf("vmm: out of memory to do copy on write on address space\n");
 				status = false;
 			} else {
-				memcpy(MAKE_HHDM(newphys), MAKE_HHDM(oldphys), PAGE_SIZE);
+				if (fromzero == false)
+					memcpy(MAKE_HHDM(newphys), MAKE_HHDM(oldphys), PAGE_SIZE);
+
 				arch_mmu_remap(_cpu()->vmmctx->pagetable, newphys, addr, range->mmuflags);
 				if ((range->flags & VMM_FLAGS_FILE) == 0 || range->vnode->type != V_TYPE_CHDEV)
 					pmm_release(oldphys);
@@ -490,7 +1158,11 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 		range->flags = VMM_PERMANENT_FLAGS_MASK & flags;
 		range->mmuflags = mmuflags;
 		__assert((flags & (VMM_FLAGS_ALLOCATE | VMM_FLAGS_PHYSICAL)) == 0);
-		unmap(space, addr, size);
+		if (unmap(space, addr, size)) {
+			freerange(range);
+			retaddr = NULL;
+			goto cleanup;
+		}
 	} else {
 		retaddr = start;
 		range->start = start;
@@ -522,7 +1194,7 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 	} else if (flags & VMM_FLAGS_ALLOCATE) {
 		// allocate to virtual memory
 		for (uintmax_t i = 0; i < size; i += PAGE_SIZE) {
-			void *allocated = pmm_allocpage(PMM_SECTION_DEFAULT);
+			void *allocated = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 			if (allocated == NULL) {
 				retaddr = NULL;
 				goto cleanup;
@@ -542,7 +1214,6 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 				retaddr = NULL;
 				goto cleanup;
 			}
-			memset(MAKE_HHDM(allocated), 0, PAGE_SIZE);
 		}
 	}
 
@@ -555,7 +1226,7 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 	return retaddr;
 }
 
-void vmm_unmap(void *addr, size_t size, int flags) {
+int vmm_unmap(void *addr, size_t size, int flags) {
 	// XXX maps where addr is not page aligned can break
 	addr = (void *)ROUND_DOWN((uintptr_t)addr, PAGE_SIZE);
 
@@ -565,11 +1236,14 @@ void vmm_unmap(void *addr, size_t size, int flags) {
 		size = ROUND_UP(size, PAGE_SIZE);
 
 	if (size == 0)
-		return;
+		return 0;
 
 	vmmspace_t *space = getspace(addr);
 	if (space == NULL)
-		return;
+		return 0;
+
+	if (flags & VMM_FLAGS_LOCKED)
+		return unmap(space, addr, size);
 
 	// the pagefault handler lock is acquired
 	// in order to prevent some consistency issues
@@ -578,12 +1252,24 @@ void vmm_unmap(void *addr, size_t size, int flags) {
 	// vmm_pagefault and vmm_unmap.
 	MUTEX_ACQUIRE(&space->pflock, false);
 	MUTEX_ACQUIRE(&space->lock, false);
-	unmap(space, addr, size);
+	int error = unmap(space, addr, size);
 	MUTEX_RELEASE(&space->lock);
 	MUTEX_RELEASE(&space->pflock);
+	return error;
+}
+
+// for the shrinkers, which can run from an allocation made with the kernel space locked (vmm_map allocating pages)
+// and so can never wait on it. kernel memory is unmapped with VMM_FLAGS_LOCKED while these are held
+bool vmm_trylockkernel() {
+	return trylockspace(&kernelspace);
+}
+
+void vmm_unlockkernel() {
+	unlockspace(&kernelspace);
 }
 
 static scache_t *ctxcache;
+static uint64_t nextctxid;
 
 static void ctxctor(scache_t *cache, void *obj) {
 	vmmcontext_t *ctx = obj;
@@ -592,6 +1278,8 @@ static void ctxctor(scache_t *cache, void *obj) {
 	MUTEX_INIT(&ctx->space.lock);
 	MUTEX_INIT(&ctx->space.pflock);
 	ctx->space.ranges = NULL;
+	ctx->space.root = NULL;
+	ctx->cpumask = 0;
 }
 
 vmmcontext_t *vmm_newcontext() {
@@ -604,6 +1292,8 @@ vmmcontext_t *vmm_newcontext() {
 	if (ctx == NULL)
 		return NULL;
 
+	ctx->id = __atomic_add_fetch(&nextctxid, 1, __ATOMIC_SEQ_CST);
+
 	ctx->pagetable = arch_mmu_newtable();
 	if (ctx->pagetable == NULL) {
 		slab_free(ctxcache, ctx);
@@ -627,7 +1317,12 @@ vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext) {
 	if (newcontext == NULL)
 		return NULL;
 
+	// the fault handler changes the page tables with only pflock held
+	MUTEX_ACQUIRE(&oldcontext->space.pflock, false);
 	MUTEX_ACQUIRE(&oldcontext->space.lock, false);
+	// nothing else can see the new context yet, except for reclaim going through the mappings of a vnode
+	MUTEX_ACQUIRE(&newcontext->space.pflock, false);
+	MUTEX_ACQUIRE(&newcontext->space.lock, false);
 
 	vmmrange_t *range = oldcontext->space.ranges;
 
@@ -643,36 +1338,46 @@ vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext) {
 			VOP_HOLD(range->vnode);
 
 		// copy any pages that are mapped
-
-		for (uintptr_t offset = 0; offset < newrange->size; offset += PAGE_SIZE) {
-			// XXX some types of mappings, like framebuffer shared mappings, will break if done this way
-			void *vaddr = (void *)((uintptr_t)newrange->start + offset);
-			void *phys = arch_mmu_getphysical(oldcontext->pagetable, vaddr);
-			if (phys == NULL)
-				continue;
-
-			if (arch_mmu_map(newcontext->pagetable, phys, vaddr, newrange->mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false)
-				goto error;
-			pmm_hold(phys);
-			arch_mmu_remap(oldcontext->pagetable, phys, vaddr, newrange->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
-		}
+		// XXX some types of mappings, like framebuffer shared mappings, will break if done this way
+		if (arch_mmu_cowcopy(newcontext->pagetable, oldcontext->pagetable, newrange->start, RANGE_TOP(newrange), newrange->mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false)
+			goto error;
 
 		range = range->next;
 	}
 
+	// the old pages were write protected without invalidating them
+	arch_mmu_invalidateall();
+	MUTEX_RELEASE(&newcontext->space.lock);
+	MUTEX_RELEASE(&newcontext->space.pflock);
 	MUTEX_RELEASE(&oldcontext->space.lock);
+	MUTEX_RELEASE(&oldcontext->space.pflock);
 	return newcontext;
 	error:
+	arch_mmu_invalidateall();
+	MUTEX_RELEASE(&newcontext->space.lock);
+	MUTEX_RELEASE(&newcontext->space.pflock);
 	MUTEX_RELEASE(&oldcontext->space.lock);
+	MUTEX_RELEASE(&oldcontext->space.pflock);
 	vmm_destroycontext(newcontext);
 	return NULL;
 }
 
 void vmm_switchcontext(vmmcontext_t *ctx) {
+	bool intstatus = interrupt_set(false);
+	vmmcontext_t *oldctx = _cpu()->vmmctx;
+	uint64_t cpubit = (uint64_t)1 << _cpu()->number;
 	if (_cpu()->thread)
 		_cpu()->thread->vmmctx = ctx;
 	_cpu()->vmmctx = ctx;
-	arch_mmu_switch(ctx->pagetable);
+
+	// the bit is set before loading the table so a shootdown can't miss this cpu,
+	// and the old one is cleared after as the switch flushed its entries
+	__atomic_or_fetch(&ctx->cpumask, cpubit, __ATOMIC_SEQ_CST);
+	arch_mmu_switch(ctx);
+	if (oldctx && oldctx != ctx)
+		__atomic_and_fetch(&oldctx->cpumask, ~cpubit, __ATOMIC_SEQ_CST);
+
+	interrupt_set(intstatus);
 }
 
 extern void *_text_start;
@@ -689,11 +1394,13 @@ void vmm_init() {
 	__assert(sizeof(vmmcache_t) <= PAGE_SIZE);
 	MUTEX_INIT(&kernelspace.lock);
 	MUTEX_INIT(&kernelspace.pflock);
+	MUTEX_INIT(&mappedlock);
 
 	cachelist = newcache();
 	vmm_kernelctx.pagetable = arch_mmu_newtable();
 	__assert(cachelist && vmm_kernelctx.pagetable);
 
+	vmm_kernelctx.id = __atomic_add_fetch(&nextctxid, 1, __ATOMIC_SEQ_CST);
 	vmm_kernelctx.space.start = USERSPACE_START;
 	vmm_kernelctx.space.end = USERSPACE_END;
 
@@ -719,8 +1426,7 @@ void vmm_init() {
 	vmm_map(MAKE_HHDM(NULL), PAGE_SIZE, VMM_FLAGS_EXACT, ARCH_MMU_FLAGS_NOEXEC, NULL);
 
 	// zero page
-	zeropage = pmm_allocpage(PMM_SECTION_DEFAULT);
-	memset(MAKE_HHDM(zeropage), 0, PAGE_SIZE);
+	zeropage = pmm_allocpage(PMM_SECTION_DEFAULT | PMM_FLAGS_ZERO);
 
 	printspace(&kernelspace);
 }
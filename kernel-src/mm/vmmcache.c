@@ -4,12 +4,42 @@
 #include <logging.h>
 #include <kernel/timekeeper.h>
 #include <kernel/event.h>
+#include <kernel/shrinker.h>
+#include <kernel/devfs.h>
 
-#define TABLE_SIZE 4096
 #define WRITER_TICK_SECONDS 15
 
+// readahead windows are in pages
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 32
+#define READAHEAD_QUEUE_SIZE 32
+
+#define TAG_DIRTY 0
+#define TAG_WRITEBACK 1
+
+// contiguous dirty pages are written together in requests of up to this many pages
+#define CLUSTER_MAX 32
+// how many pages the writer writes from a vnode before going to the next one
+#define WRITER_VNODE_MAX 256
+
+#define WINDOW_FLAGS (ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC)
+
+// dirty memory limits in percent of memory. the writer is started once the background limit is crossed,
+// writers are slowed down past it and stopped at the hard limit until enough is written back.
+// a single device only gets a part of them, so a slow device can't stall the writes to the others
+#define DIRTY_BACKGROUND_PERCENT 10
+#define DIRTY_HARD_PERCENT 20
+#define DIRTY_DEVICE_SHARE 2
+
+// longest a writer is paused for at a time, and the writeback rate assumed for a device not written to yet
+#define THROTTLE_MAX_US 100000
+#define THROTTLE_DEFAULT_RATE 2560
+
+// the pages of each vnode are in a radix tree protected by the pageslock of the vnode, so lookups don't
+// touch any global state. the global lock protects the dirty vnode list, the dirty counts of the vnodes
+// and the TRUNCATED and DIRTY flags, the lock order being global lock -> pageslock.
+// the vnode lock is never held while allocating memory, as that can reclaim pages from the same vnode
 static mutex_t mutex;
-static page_t **table;
 
 static thread_t *writerthread;
 static semaphore_t sync;
@@ -17,108 +47,232 @@ static eventheader_t syncevent;
 static eventheader_t pagereadyevent;
 size_t vmmcache_cachedpages;
 
+// vnodes with dirty pages, oldest first
+static vnode_t *dirtyhead;
+static vnode_t *dirtytail;
+
+// pages that are dirty or being written back, and the limits for them in pages
+static size_t dirtypages;
+static size_t dirtybackground;
+static size_t dirtyhard;
+// set when the writer was woken up for the background limit, cleared when it runs out of work
+static bool writerkicked;
+static eventheader_t cleanevent;
+
+// kernel virtual memory clusters of pages that aren't physically contiguous are mapped to for writing
+static void *window;
+static mutex_t windowmutex;
+
+typedef struct {
+	vnode_t *vnode;
+	uintmax_t offset;
+	size_t count;
+} readahead_t;
+
+// readahead requests are queued here and done by the readahead thread
+static thread_t *readaheadthread;
+static mutex_t readaheadmutex;
+static semaphore_t readaheadsem;
+static readahead_t readaheadqueue[READAHEAD_QUEUE_SIZE];
+static int readaheadhead;
+static int readaheadcount;
+
 #define HOLD_LOCK() \
 	MUTEX_ACQUIRE(&mutex, false);
 
 #define RELEASE_LOCK() \
 	MUTEX_RELEASE(&mutex);
 
-static inline uint64_t fnv1ahash(void *buffer, size_t size);
-static uintmax_t getentry(vnode_t *vnode, uintmax_t offset) {
-	struct {
-		vnode_t *vnode;
-		uintmax_t offset;
-	} tmp;
+#define VNODE_LOCK(v) \
+	MUTEX_ACQUIRE(&(v)->pageslock, false);
 
-	tmp.vnode = vnode;
-	tmp.offset = offset;
+#define VNODE_UNLOCK(v) \
+	MUTEX_RELEASE(&(v)->pageslock);
 
-	return fnv1ahash(&tmp, sizeof(tmp)) % TABLE_SIZE;
+// assumes lock is held
+static void dirtyinsert(vnode_t *vnode) {
+	vnode->dirtynext = NULL;
+	vnode->dirtyprev = dirtytail;
+	if (dirtytail)
+		dirtytail->dirtynext = vnode;
+	else
+		dirtyhead = vnode;
+
+	dirtytail = vnode;
 }
 
 // assumes lock is held
-static page_t *findpage(vnode_t *vnode, uintmax_t offset) {
-	uintmax_t entry = getentry(vnode, offset);
+static void dirtyremove(vnode_t *vnode) {
+	if (vnode->dirtynext)
+		vnode->dirtynext->dirtyprev = vnode->dirtyprev;
+	else
+		dirtytail = vnode->dirtyprev;
 
-	page_t *page = table[entry];
-	while (page) {
-		if (page->backing == vnode && page->offset == offset)
-			break;
-		page = page->hashnext;
+	if (vnode->dirtyprev)
+		vnode->dirtyprev->dirtynext = vnode->dirtynext;
+	else
+		dirtyhead = vnode->dirtynext;
+
+	vnode->dirtynext = NULL;
+	vnode->dirtyprev = NULL;
+}
+
+// the device the dirty pages of the vnode are accounted to
+static vwriteback_t *getwriteback(vnode_t *vnode) {
+	if (vnode->type == V_TYPE_BLKDEV) {
+		devnode_t *devnode = (devnode_t *)vnode;
+		return devnode->master ? &devnode->master->writeback : &devnode->writeback;
 	}
 
-	return page;
+	return &vnode->vfs->writeback;
 }
 
-// assumes lock is held
-static void putpage(page_t *page) {
-	uintmax_t entry = getentry(page->backing, page->offset);
-	// add to table list
-	page->hashprev = NULL;
-	page->hashnext = table[entry];
-	if (table[entry])
-		table[entry]->hashprev = page;
+// called with lock held
+static void kickwriter() {
+	if (writerkicked)
+		return;
 
-	table[entry] = page;
+	writerkicked = true;
+	semaphore_signal(&sync);
+}
 
-	// add to vnode list
-	// XXX this could be a bit slow if a large portion of the file is in memory and it gets purged
-	page->vnodeprev = NULL;
-	page->vnodenext = page->backing->pages;
-	if (page->backing->pages)
-		page->backing->pages->vnodeprev = page;
+static void accountdirty(vnode_t *vnode, long count) {
+	__atomic_add_fetch(&dirtypages, count, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&getwriteback(vnode)->dirtypages, count, __ATOMIC_SEQ_CST);
+}
 
-	page->backing->pages = page;
-	++vmmcache_cachedpages;
+// assumes vnode lock is held
+static page_t *findpage(vnode_t *vnode, uintmax_t offset) {
+	return radix_lookup(&vnode->pages, offset / PAGE_SIZE);
 }
 
-// assumes lock is held
-static void removepage(page_t *page) {
-	uintmax_t entry = getentry(page->backing, page->offset);
+// assumes vnode lock is held
+static void putpage(page_t *page, radixnode_t **spare) {
+	radix_insert(&page->backing->pages, page->offset / PAGE_SIZE, page, spare);
+	__atomic_add_fetch(&vmmcache_cachedpages, 1, __ATOMIC_SEQ_CST);
+}
 
-	// remove from table list
-	if (page->hashnext)
-		page->hashnext->hashprev = page->hashprev;
+// assumes vnode lock is held
+static void removepage(page_t *page, radixnode_t **freed) {
+	__assert(radix_remove(&page->backing->pages, page->offset / PAGE_SIZE, freed) == page);
+	__atomic_sub_fetch(&vmmcache_cachedpages, 1, __ATOMIC_SEQ_CST);
+}
 
-	if (page->hashprev)
-		page->hashprev->hashnext = page->hashnext;
-	else
-		table[entry] = page->hashnext;
+// adds a page to the cache at offset if there isn't one there already.
+// the nodes needed for the radix tree are allocated with the vnode lock released
+static int addpage(vnode_t *vnode, uintmax_t offset, page_t *page) {
+	radixnode_t *spare = NULL;
+	size_t sparecount = 0;
+	int error = 0;
 
-	page->hashnext = NULL;
-	page->hashprev = NULL;
+	VNODE_LOCK(vnode);
+	for (;;) {
+		if (findpage(vnode, offset)) {
+			error = EEXIST;
+			break;
+		}
 
-	// remove from vnode list
-	if (page->vnodenext)
-		page->vnodenext->vnodeprev = page->vnodeprev;
+		size_t needed = radix_nodesneeded(&vnode->pages, offset / PAGE_SIZE);
+		if (needed <= sparecount) {
+			page->backing = vnode;
+			page->offset = offset;
+			putpage(page, &spare);
+			break;
+		}
 
-	if (page->vnodeprev)
-		page->vnodeprev->vnodenext = page->vnodenext;
-	else
-		page->backing->pages = page->vnodenext;
+		VNODE_UNLOCK(vnode);
+		radix_freenodes(spare);
+		spare = radix_allocnodes(needed);
+		sparecount = spare ? needed : 0;
+		VNODE_LOCK(vnode);
+
+		if (spare == NULL) {
+			error = ENOMEM;
+			break;
+		}
+	}
+	VNODE_UNLOCK(vnode);
 
-	page->vnodenext = NULL;
-	page->vnodeprev = NULL;
-	--vmmcache_cachedpages;
+	radix_freenodes(spare);
+	return error;
+}
+
+// takes a page that failed to be read out of the cache, tells the sleeping threads
+// and turns it into an anonymous page again
+static void pageerror(page_t *page) {
+	radixnode_t *freed = NULL;
+	vnode_t *vnode = page->backing;
+	VNODE_LOCK(vnode);
+	removepage(page, &freed);
+
+	page->flags |= PAGE_FLAGS_ERROR;
+	page->backing = NULL;
+	page->offset = 0;
+
+	VNODE_UNLOCK(vnode);
+	radix_freenodes(freed);
+	pmm_release(pmm_getpageaddress(page));
+	EVENT_SIGNAL(&pagereadyevent);
+}
+
+// assumes vnode lock is held.
+// accesses that continue where the last one left off (or start at the beginning) are sequential and grow
+// the readahead window of the vnode, anything else resets it. when the window gets past what was already
+// requested, the pages up to the end of it are queued for the readahead thread
+static void readahead(vnode_t *vnode, uintmax_t offset) {
+	if (offset == 0 || offset == vnode->ranext) {
+		vnode->rawindow = vnode->rawindow ? vnode->rawindow * 2 : READAHEAD_MIN;
+		if (vnode->rawindow > READAHEAD_MAX)
+			vnode->rawindow = READAHEAD_MAX;
+	} else {
+		vnode->rawindow = 0;
+		vnode->raend = 0;
+	}
+
+	vnode->ranext = offset + PAGE_SIZE;
+	if (vnode->rawindow == 0)
+		return;
+
+	uintmax_t start = vnode->raend > vnode->ranext ? vnode->raend : vnode->ranext;
+	uintmax_t end = vnode->ranext + vnode->rawindow * PAGE_SIZE;
+
+	// only issue it once at least half a window can be requested, so the requests stay big
+	if (end <= start || (end - start) / PAGE_SIZE < vnode->rawindow / 2)
+		return;
+
+	MUTEX_ACQUIRE(&readaheadmutex, false);
+	if (readaheadcount == READAHEAD_QUEUE_SIZE) {
+		MUTEX_RELEASE(&readaheadmutex);
+		return;
+	}
+
+	readahead_t *request = &readaheadqueue[(readaheadhead + readaheadcount) % READAHEAD_QUEUE_SIZE];
+	request->vnode = vnode;
+	request->offset = start;
+	request->count = (end - start) / PAGE_SIZE;
+	++readaheadcount;
+	vnode->raend = end;
+	VOP_HOLD(vnode);
+	MUTEX_RELEASE(&readaheadmutex);
+	semaphore_signal(&readaheadsem);
 }
 
 int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 	__assert(vnode->type == V_TYPE_REGULAR || vnode->type == V_TYPE_BLKDEV);
 	__assert((offset % PAGE_SIZE) == 0);
-	retry_err:
-	HOLD_LOCK();
+	bool first = true;
 
-	page_t *newpage = NULL;
-	volatile page_t *page = findpage(vnode, offset);
 	retry:
+	VNODE_LOCK(vnode);
+	if (first)
+		readahead(vnode, offset);
+	first = false;
+
+	volatile page_t *page = findpage(vnode, offset);
 	if (page) {
 		// page is present in the page cache
 		pmm_hold(pmm_getpageaddress((page_t *)page));
-		RELEASE_LOCK();
-
-		// in the case of a retry, release the allocated page here
-		if (newpage)
-			pmm_release(pmm_getpageaddress(newpage));
+		VNODE_UNLOCK(vnode);
 
 		eventlistener_t listener;
 		EVENT_INITLISTENER(&listener);
@@ -133,89 +287,85 @@ int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 		if (page->flags & PAGE_FLAGS_ERROR) {
 			// the thread handling the page in failed to read it, we should retry it and see whats up
 			pmm_release(pmm_getpageaddress((page_t *)page));
-			goto retry_err;
+			goto retry;
 		}
 
+		pmm_markaccessed((page_t *)page);
 		*res = (page_t *)page;
-	} else {
-		// page is not present in the cache, we will have to load it in
-		RELEASE_LOCK();
-
-		void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
-		if (address == NULL)
-			return ENOMEM;
-
-		newpage = pmm_getpage(address);
-		
-		HOLD_LOCK();
-
-		// while the lock wasn't being held, the page could have potentially been added to the cache
-		// check for it again and return from the function as if it was always there in the first place
-		page = findpage(vnode, offset);
-		if (page)
-			goto retry;
+		return 0;
+	}
 
-		newpage->backing = vnode;
-		newpage->offset = offset;
+	// page is not present in the cache, we will have to load it in
+	VNODE_UNLOCK(vnode);
 
-		// add it to the page cache
-		putpage(newpage);
+	void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+	if (address == NULL)
+		return ENOMEM;
 
-		RELEASE_LOCK();
+	page_t *newpage = pmm_getpage(address);
 
-		int error = VOP_GETPAGE(vnode, offset, newpage);
+	// while the lock wasn't being held, the page could have potentially been added to the cache
+	// if so, retry as if it was always there in the first place
+	int error = addpage(vnode, offset, newpage);
+	if (error) {
+		pmm_release(address);
+		if (error == EEXIST)
+			goto retry;
+		return error;
+	}
 
-		if (error) {
-			// an error happened with GETPAGE, remove the page from the cache,
-			// tell the sleeping threads that something happened and free the page
-			// by setting backing to null so it gets treated as an anonymous page again
-			HOLD_LOCK();
-			removepage(newpage);
+	error = VOP_GETPAGE(vnode, offset, newpage);
+	if (error) {
+		pageerror(newpage);
+		return error;
+	}
 
-			newpage->flags |= PAGE_FLAGS_ERROR;
-			newpage->backing = NULL;
-			newpage->offset = 0;
+	// this counts as the first use of the page, pages brought in by readahead get it when they are first used
+	newpage->flags |= PAGE_FLAGS_READY | PAGE_FLAGS_REFERENCED;
+	EVENT_SIGNAL(&pagereadyevent);
+	*res = newpage;
+	return 0;
+}
 
-			RELEASE_LOCK();
-			pmm_release(pmm_getpageaddress(newpage));
-			EVENT_SIGNAL(&pagereadyevent);
-			return error;
-		}
+// returns a held page only if it's already in the cache and ready, never doing any io
+int vmmcache_getresident(vnode_t *vnode, uintmax_t offset, page_t **res) {
+	__assert((offset % PAGE_SIZE) == 0);
+	VNODE_LOCK(vnode);
 
-		newpage->flags |= PAGE_FLAGS_READY;
-		EVENT_SIGNAL(&pagereadyevent);
-		*res = newpage;
+	page_t *page = findpage(vnode, offset);
+	if (page == NULL || (page->flags & (PAGE_FLAGS_READY | PAGE_FLAGS_ERROR)) != PAGE_FLAGS_READY) {
+		VNODE_UNLOCK(vnode);
+		return ENOENT;
 	}
 
-	RELEASE_LOCK();
+	pmm_hold(pmm_getpageaddress(page));
+	VNODE_UNLOCK(vnode);
+	*res = page;
 	return 0;
 }
 
 // adds a page to the cache in a specific offset if its not already there
 int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page) {
 	__assert((offset % PAGE_SIZE) == 0);
-	HOLD_LOCK();
-
-	page_t *pagetest = findpage(vnode, offset);
-	if (pagetest) {
-		RELEASE_LOCK();
-		return EAGAIN;
-	}
-
-	page->backing = vnode;
-	page->offset = offset;
 	page->flags |= PAGE_FLAGS_READY;
+	int error = addpage(vnode, offset, page);
+	if (error) {
+		page->flags &= ~PAGE_FLAGS_READY;
+		return error == EEXIST ? EAGAIN : error;
+	}
 
-	putpage(page);
-
-	RELEASE_LOCK();
 	return 0;
 }
 
-// removes a page from the cache AND turns it into anonymous memory
+// removes a page from the cache AND turns it into anonymous memory.
+// the caller holds the page and a reference to the vnode
 int vmmcache_evict(page_t *page) {
+	radixnode_t *freed = NULL;
+	vnode_t *vnode = page->backing;
 	HOLD_LOCK();
+	VNODE_LOCK(vnode);
 	if (page->refcount > 1) {
+		VNODE_UNLOCK(vnode);
 		RELEASE_LOCK();
 		return EAGAIN;
 	}
@@ -224,23 +374,37 @@ int vmmcache_evict(page_t *page) {
 
 	if ((page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
 		// the page needs to be removed from the cache to continue
-		removepage(page);
+		removepage(page, &freed);
 	}
 
 	page->flags = 0;
 	page->backing = NULL;
 	page->offset = 0;
 
+	VNODE_UNLOCK(vnode);
 	RELEASE_LOCK();
+	radix_freenodes(freed);
 	return 0;
 }
 
 // removes a page from the cache *but doesn't do anything to it*
 int vmmcache_takepage(page_t *page) {
+	radixnode_t *freed = NULL;
 	HOLD_LOCK();
+
+	// truncated pages aren't in the cache anymore, and their vnode might be gone already
+	if (page->flags & PAGE_FLAGS_TRUNCATED) {
+		int error = page->refcount > 1 ? EAGAIN : 0;
+		RELEASE_LOCK();
+		return error;
+	}
+
+	vnode_t *vnode = page->backing;
+	VNODE_LOCK(vnode);
 	// someone called vmmcache_getpage() and got this page while the lock wasn't held
 	// return an error status to the caller
 	if (page->refcount > 1) {
+		VNODE_UNLOCK(vnode);
 		RELEASE_LOCK();
 		return EAGAIN;
 	}
@@ -248,124 +412,188 @@ int vmmcache_takepage(page_t *page) {
 	__assert(page->refcount == 1);
 	__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
 
-	// XXX maybe just not allow truncated pages to take up space like this?
-	if ((page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
-		// the page needs to be removed from the cache to continue
-		removepage(page);
-	}
+	// the page needs to be removed from the cache to continue
+	removepage(page, &freed);
 
+	VNODE_UNLOCK(vnode);
 	RELEASE_LOCK();
+	radix_freenodes(freed);
 	return 0;
 }
 
 int vmmcache_truncate(vnode_t *vnode, uintmax_t offset) {
+	radixnode_t *freed = NULL;
+	uintmax_t index = ROUND_UP(offset, PAGE_SIZE) / PAGE_SIZE;
 	HOLD_LOCK();
-	page_t *pagelist = NULL;
-	page_t *page = vnode->pages;
-
-	while (page) {
-		page_t *oldpage = page;
-		page = page->vnodenext;
-
-		// only truncate past a certain offset
-		if (oldpage->offset < offset)
-			continue;
-
-		oldpage->flags |= PAGE_FLAGS_TRUNCATED;
-		removepage(oldpage);
-		oldpage->vnodenext = pagelist;
-		pagelist = oldpage;
-	}
-
-	RELEASE_LOCK();
+	VNODE_LOCK(vnode);
+	bool wasdirty = vnode->dirtycount > 0;
+
+	// only truncate past a certain offset
+	page_t *page;
+	while ((page = radix_next(&vnode->pages, &index, RADIX_TAG_NONE))) {
+		page->flags |= PAGE_FLAGS_TRUNCATED;
+		removepage(page, &freed);
+
+		// dirty pages don't need to be written anymore, drop the references the dirty state had.
+		// the caller holds the vnode so this can't be the last reference to it
+		if (page->flags & PAGE_FLAGS_DIRTY) {
+			vnode_t *held = vnode;
+			page->flags &= ~PAGE_FLAGS_DIRTY;
+			--vnode->dirtycount;
+			accountdirty(vnode, -1);
+			VOP_RELEASE(held);
+			pmm_release(pmm_getpageaddress(page));
+		}
 
-	// make sure to unref if they are pinned
-	while (pagelist) {
-		page_t *page = pagelist;
-		pagelist = pagelist->vnodenext;
+		// make sure to unref if they are pinned
 		if (page->flags & PAGE_FLAGS_PINNED)
 			pmm_release(pmm_getpageaddress(page));
 	}
 
+	if (wasdirty && vnode->dirtycount == 0)
+		dirtyremove(vnode);
+
+	VNODE_UNLOCK(vnode);
+	RELEASE_LOCK();
+	radix_freenodes(freed);
 	return 0;
 }
 
-// called with lock held
-// returns with lock released
-static int syncpage(page_t *page) {
-	__assert(page->flags & PAGE_FLAGS_DIRTY);
-	page->flags &= ~PAGE_FLAGS_DIRTY;
-	RELEASE_LOCK();
-	int e = 0;
-	if ((page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
-		e = VOP_PUTPAGE(page->backing, page->offset, (page_t *)page);
-		VOP_RELEASE(page->backing);
-	} else {
-		// page got truncated from the file while waiting to be written to disk
-		// its still holding a reference to the vnode, so release that
-		VOP_RELEASE(page->backing);
+// assumes lock and vnode lock are held.
+// takes the run of contiguous dirty pages starting at the first one at or after *index and below top,
+// marking them as under writeback, and returns how many were taken
+static size_t takecluster(vnode_t *vnode, uintmax_t *index, uintmax_t top, page_t **pages, size_t max) {
+	size_t count = 0;
+	page_t *page = radix_next(&vnode->pages, index, TAG_DIRTY);
+	while (page && page->offset < top && count < max) {
+		__assert(page->flags & PAGE_FLAGS_DIRTY);
+		page->flags &= ~PAGE_FLAGS_DIRTY;
+		radix_cleartag(&vnode->pages, *index + count, TAG_DIRTY);
+		radix_settag(&vnode->pages, *index + count, TAG_WRITEBACK);
+		pages[count++] = page;
+
+		uintmax_t next = *index + count;
+		page = radix_gettag(&vnode->pages, next, TAG_DIRTY) ? radix_lookup(&vnode->pages, next) : NULL;
 	}
 
-	pmm_release(pmm_getpageaddress((page_t *)page));
-	return e;
+	vnode->dirtycount -= count;
+	if (count && vnode->dirtycount == 0)
+		dirtyremove(vnode);
+
+	return count;
 }
 
-static page_t *dirtylist;
+// writes a cluster taken by takecluster with a single putpages if it can be mapped contiguously and drops
+// the references the dirty state had. the caller holds the vnode
+static int writecluster(vnode_t *vnode, page_t **pages, size_t count) {
+	bool contiguous = true;
+	for (size_t i = 1; i < count; ++i) {
+		if (pmm_getpageaddress(pages[i]) != (void *)((uintptr_t)pmm_getpageaddress(pages[0]) + i * PAGE_SIZE))
+			contiguous = false;
+	}
 
-int vmmcache_syncvnode(vnode_t *vnode, uintmax_t offset, size_t size) {
-	offset = ROUND_DOWN(offset, PAGE_SIZE);
-	uintmax_t top = offset + size;
-	// overflow check
-	__assert(top > offset);
-	HOLD_LOCK();
+	int e = 0;
+	bool done = false;
+	timespec_t start = timekeeper_timefromboot();
+	if (contiguous) {
+		e = VOP_PUTPAGES(vnode, pages[0]->offset, MAKE_HHDM(pmm_getpageaddress(pages[0])), count);
+		done = true;
+	} else {
+		MUTEX_ACQUIRE(&windowmutex, false);
+		size_t mapped = 0;
+		while (mapped < count && arch_mmu_map(_cpu()->vmmctx->pagetable, pmm_getpageaddress(pages[mapped]), (void *)((uintptr_t)window + mapped * PAGE_SIZE), WINDOW_FLAGS))
+			++mapped;
+
+		if (mapped == count) {
+			e = VOP_PUTPAGES(vnode, pages[0]->offset, window, count);
+			done = true;
+		}
 
-	// loop through all vnode pages in memory and check which ones are in the range and are dirty
-	// TODO create a proper vnode dirty list as to not have to loop through the ENTIRE thing in memory
-	page_t *page = vnode->pages;
-	page_t *vnodedirtylist = NULL;
-	for (; page; page = page->vnodenext) {
-		if (page->offset < offset || page->offset >= top || (page->offset & PAGE_FLAGS_DIRTY) == 0)
-			continue;
+		mmubatch_t batch;
+		arch_mmu_batchinit(&batch);
+		for (size_t i = 0; i < mapped; ++i)
+			arch_mmu_unmapbatch(_cpu()->vmmctx->pagetable, (void *)((uintptr_t)window + i * PAGE_SIZE), &batch);
 
-		// remove from write list and add to an internal list using the write pointers
-		// in a singly linked list way
-		if (page->writenext)
-			page->writenext->writeprev = page->writeprev;
+		arch_mmu_batchflush(&batch);
+		MUTEX_RELEASE(&windowmutex);
+	}
 
-		if (page->writeprev)
-			page->writeprev->writenext = page->writenext;
-		else
-			dirtylist = page->writenext;
+	// the page tables for the window couldn't be allocated, write the pages one by one
+	for (size_t i = 0; done == false && i < count; ++i) {
+		int error = VOP_PUTPAGES(vnode, pages[i]->offset, MAKE_HHDM(pmm_getpageaddress(pages[i])), 1);
+		if (e == 0)
+			e = error;
+	}
 
-		page->writenext = vnodedirtylist;
-		page->writeprev = NULL;
-		vnodedirtylist = page;
+	// average the rate of the device over the last writes. concurrent updates can lose a sample, which is fine
+	vwriteback_t *writeback = getwriteback(vnode);
+	time_t us = timespec_diffus(timekeeper_timefromboot(), start);
+	size_t rate = count * 1000000 / (us ? us : 1);
+	writeback->rate = writeback->rate ? (writeback->rate * 7 + rate) / 8 : rate;
+
+	// the pages could have been truncated while they were being written
+	VNODE_LOCK(vnode);
+	for (size_t i = 0; i < count; ++i) {
+		if (findpage(vnode, pages[i]->offset) == pages[i])
+			radix_cleartag(&vnode->pages, pages[i]->offset / PAGE_SIZE, TAG_WRITEBACK);
 	}
+	VNODE_UNLOCK(vnode);
 
-	RELEASE_LOCK();
+	accountdirty(vnode, -(long)count);
+	EVENT_SIGNAL(&cleanevent);
+
+	for (size_t i = 0; i < count; ++i) {
+		vnode_t *held = vnode;
+		VOP_RELEASE(held);
+		pmm_release(pmm_getpageaddress(pages[i]));
+	}
+
+	return e;
+}
 
+// writes up to max dirty pages of the vnode in [offset, top) in offset order, the caller holds the vnode.
+// in the case of failure, only the first error to occur will be reported and we will not
+// retry the write and keep on syncing the pages to disk
+static int writeback(vnode_t *vnode, uintmax_t offset, uintmax_t top, size_t max) {
+	page_t *pages[CLUSTER_MAX];
+	uintmax_t index = offset / PAGE_SIZE;
+	size_t written = 0;
 	int e = 0;
-	while (vnodedirtylist) {
-		// in the case of failure, only the first error to occur will be reported and we will not
-		// retry the write and keep on syncing the pages to disk
+
+	while (written < max) {
 		HOLD_LOCK();
-		page_t *page = vnodedirtylist;
-		vnodedirtylist = vnodedirtylist->writenext;
-		page->writenext = NULL;
-		int error = syncpage(page);
+		VNODE_LOCK(vnode);
+		size_t count = takecluster(vnode, &index, top, pages, min(max - written, CLUSTER_MAX));
+		VNODE_UNLOCK(vnode);
+		RELEASE_LOCK();
+
+		if (count == 0)
+			break;
+
+		int error = writecluster(vnode, pages, count);
 		if (e == 0)
 			e = error;
-		// syncpage returns with lock released
+
+		written += count;
+		index += count;
 	}
 
 	return e;
 }
 
+int vmmcache_syncvnode(vnode_t *vnode, uintmax_t offset, size_t size) {
+	offset = ROUND_DOWN(offset, PAGE_SIZE);
+	uintmax_t top = offset + size;
+	// overflow check
+	__assert(top > offset);
+	return writeback(vnode, offset, top, (size_t)-1);
+}
+
 int vmmcache_sync() {
 	eventlistener_t eventlistener;
 	EVENT_INITLISTENER(&eventlistener);
 	HOLD_LOCK();
-	if (dirtylist == NULL) {
+	if (dirtyhead == NULL) {
 		// no dirty pages
 		RELEASE_LOCK();
 		return 0;
@@ -387,18 +615,23 @@ int vmmcache_makedirty(page_t *page) {
 
 	if ((page->flags & (PAGE_FLAGS_DIRTY | PAGE_FLAGS_TRUNCATED)) == 0) {
 		madedirty = true;
-		// page is neither dirty nor truncated, add to dirty list and hold the page and vnode
+		// page is neither dirty nor truncated, tag it dirty and hold the page and vnode.
+		// the vnode goes to the back of the dirty list with its first dirty page
 		page->flags |= PAGE_FLAGS_DIRTY;
-
-		page->writeprev = NULL;
-		page->writenext = dirtylist;
-		if (dirtylist)
-			dirtylist->writeprev = page;
-
-		dirtylist = page;
 		pmm_hold(pmm_getpageaddress(page));
 		__assert(page->backing);
 		VOP_HOLD(page->backing);
+
+		VNODE_LOCK(page->backing);
+		radix_settag(&page->backing->pages, page->offset / PAGE_SIZE, TAG_DIRTY);
+		VNODE_UNLOCK(page->backing);
+
+		if (page->backing->dirtycount++ == 0)
+			dirtyinsert(page->backing);
+
+		accountdirty(page->backing, 1);
+		if (dirtypages > dirtybackground || getwriteback(page->backing)->dirtypages > dirtybackground / DIRTY_DEVICE_SHARE)
+			kickwriter();
 	}
 
 	RELEASE_LOCK();
@@ -410,6 +643,150 @@ int vmmcache_makedirty(page_t *page) {
 	return 0;
 }
 
+// how far dirty is between the background and hard limits, in 1024ths
+static size_t limitposition(size_t dirty, size_t background, size_t hard) {
+	if (dirty <= background)
+		return 0;
+
+	return (dirty - background) * 1024 / (hard - background);
+}
+
+// called after writing size bytes to the vnode through the cache, with no locks held.
+// past the background limit the caller is paused for about as long as the device takes to write
+// what it just dirtied, scaled by how close to the hard limit things are. past the hard limit it
+// waits until writeback brings the dirty pages back under it
+void vmmcache_throttle(vnode_t *vnode, size_t size) {
+	if ((vnode->type != V_TYPE_REGULAR && vnode->type != V_TYPE_BLKDEV) || size == 0)
+		return;
+
+	// the writer dirties metadata while writing back and can't wait on itself
+	if (_cpu()->thread == writerthread)
+		return;
+
+	vwriteback_t *writeback = getwriteback(vnode);
+	size_t pages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+	size_t devicebackground = dirtybackground / DIRTY_DEVICE_SHARE;
+	size_t devicehard = dirtyhard / DIRTY_DEVICE_SHARE;
+
+	for (;;) {
+		size_t global = __atomic_load_n(&dirtypages, __ATOMIC_SEQ_CST);
+		size_t device = __atomic_load_n(&writeback->dirtypages, __ATOMIC_SEQ_CST);
+		if (global <= dirtybackground && device <= devicebackground)
+			return;
+
+		HOLD_LOCK();
+		kickwriter();
+		RELEASE_LOCK();
+
+		if (global < dirtyhard && device < devicehard) {
+			size_t position = limitposition(global, dirtybackground, dirtyhard);
+			size_t deviceposition = limitposition(device, devicebackground, devicehard);
+			if (deviceposition > position)
+				position = deviceposition;
+
+			size_t rate = writeback->rate ? writeback->rate : THROTTLE_DEFAULT_RATE;
+			size_t us = pages * 1000000 / rate * position / 1024;
+			if (us)
+				sched_sleepus(min(us, THROTTLE_MAX_US));
+			return;
+		}
+
+		// over the hard limit, wait for some pages to be written and check again
+		eventlistener_t listener;
+		EVENT_INITLISTENER(&listener);
+		EVENT_ATTACH(&listener, &cleanevent);
+		EVENT_WAIT(&listener, THROTTLE_MAX_US);
+		EVENT_DETACHALL(&listener);
+	}
+}
+
+// marks a page read by the readahead thread as ready, or takes it out of the cache if the read failed,
+// the same way vmmcache_getpage does
+static void readaheaddone(page_t *page, int error) {
+	if (error) {
+		pageerror(page);
+		return;
+	}
+
+	page->flags |= PAGE_FLAGS_READY;
+	pmm_release(pmm_getpageaddress(page));
+	EVENT_SIGNAL(&pagereadyevent);
+}
+
+static void doreadahead(vnode_t *vnode, uintmax_t offset, size_t count) {
+	page_t *pages[READAHEAD_MAX];
+	__assert(count <= READAHEAD_MAX);
+
+	// a block device page is just a read from the device and some filesystems can fill several pages at once,
+	// so if the memory is physically contiguous each run of pages can be read with a single request
+	void *block = NULL;
+	if (vnode->type == V_TYPE_BLKDEV || vnode->ops->getpages)
+		block = pmm_alloc(count, PMM_SECTION_DEFAULT | PMM_FLAGS_NORECLAIM);
+
+	for (size_t i = 0; i < count; ++i) {
+		void *address = block ? (void *)((uintptr_t)block + i * PAGE_SIZE) : pmm_allocpage(PMM_SECTION_DEFAULT);
+		if (address == NULL) {
+			count = i;
+			break;
+		}
+		pages[i] = pmm_getpage(address);
+	}
+
+	// pages that got in the cache some other way are dropped, the rest are added as not ready yet
+	for (size_t i = 0; i < count; ++i) {
+		if (addpage(vnode, offset + i * PAGE_SIZE, pages[i])) {
+			pmm_release(pmm_getpageaddress(pages[i]));
+			pages[i] = NULL;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		if (pages[i] == NULL)
+			continue;
+
+		if (block == NULL) {
+			readaheaddone(pages[i], VOP_GETPAGE(vnode, pages[i]->offset, pages[i]));
+			continue;
+		}
+
+		// read the whole run of pages that were added
+		size_t run = 1;
+		while (i + run < count && pages[i + run])
+			++run;
+
+		void *buffer = MAKE_HHDM(pmm_getpageaddress(pages[i]));
+		size_t readpages = 0;
+		int error;
+		if (vnode->type == V_TYPE_BLKDEV) {
+			size_t readc = 0;
+			error = VOP_READ(vnode, buffer, run * PAGE_SIZE, pages[i]->offset, 0, &readc, NULL);
+			readpages = ROUND_UP(readc, PAGE_SIZE) / PAGE_SIZE;
+		} else {
+			error = VOP_GETPAGES(vnode, pages[i]->offset, buffer, run, &readpages);
+		}
+
+		for (size_t j = 0; j < run; ++j)
+			readaheaddone(pages[i + j], error ? error : (j < readpages ? 0 : ENXIO));
+
+		i += run - 1;
+	}
+}
+
+static void readaheadworker() {
+	for (;;) {
+		semaphore_wait(&readaheadsem, false);
+		MUTEX_ACQUIRE(&readaheadmutex, false);
+		__assert(readaheadcount);
+		readahead_t request = readaheadqueue[readaheadhead];
+		readaheadhead = (readaheadhead + 1) % READAHEAD_QUEUE_SIZE;
+		--readaheadcount;
+		MUTEX_RELEASE(&readaheadmutex);
+
+		doreadahead(request.vnode, request.offset, request.count);
+		VOP_RELEASE(request.vnode);
+	}
+}
+
 static void tick(context_t *, dpcarg_t arg) {
 	semaphore_signal(&sync);
 }
@@ -422,36 +799,87 @@ static void writer() {
 	interrupt_set(true);
 	for (;;) {
 		HOLD_LOCK();
-		// TODO make FIFO rather than LIFO
-		volatile page_t *page = dirtylist;
-		if (page == NULL) {
+		vnode_t *vnode = dirtyhead;
+		if (vnode == NULL) {
 			EVENT_SIGNAL(&syncevent);
+			writerkicked = false;
 			RELEASE_LOCK();
 			semaphore_wait(&sync, false);
 			continue;
 		}
 
-		dirtylist = page->writenext;
-		if (dirtylist)
-			dirtylist->writeprev = NULL;
+		// the oldest dirty vnode goes to the back of the list before being written,
+		// so a vnode with a lot of dirty pages doesn't hold back the others
+		dirtyremove(vnode);
+		dirtyinsert(vnode);
+		VOP_HOLD(vnode);
+		RELEASE_LOCK();
 
-		page->writenext = NULL;
 		// TODO notify error on vmmcache_syncvnode
-		syncpage((page_t *)page);
+		writeback(vnode, 0, (uintmax_t)-1, WRITER_VNODE_MAX);
+		VOP_RELEASE(vnode);
 	}
 }
 
+// clean pages nobody references sit in the pmm standby lists and can be dropped at any time.
+// dirty pages are held by their dirty state until they are written, so they never show up here
+static size_t shrinkercount(shrinker_t *shrinker) {
+	return pmm_standbycount();
+}
+
+static size_t shrinkerscan(shrinker_t *shrinker, size_t count) {
+	return pmm_reclaimstandby(count);
+}
+
+static shrinker_t cacheshrinker = {
+	.count = shrinkercount,
+	.scan = shrinkerscan
+};
+
+// pages mapped somewhere are only freed after their mappings are gone, which is more work than dropping
+// standby pages, so this one goes after the standby shrinker. the count is very rough, it includes the dirty pages
+static size_t mappedshrinkercount(shrinker_t *shrinker) {
+	size_t standby = pmm_standbycount();
+	size_t cached = __atomic_load_n(&vmmcache_cachedpages, __ATOMIC_SEQ_CST);
+	return cached > standby ? cached - standby : 0;
+}
+
+static size_t mappedshrinkerscan(shrinker_t *shrinker, size_t count) {
+	size_t unmapped = vmm_unmapcold(count);
+	return unmapped ? pmm_reclaimstandby(unmapped) : 0;
+}
+
+static shrinker_t mappedshrinker = {
+	.count = mappedshrinkercount,
+	.scan = mappedshrinkerscan
+};
+
 void vmmcache_init() {
 	MUTEX_INIT(&mutex);
-	table = vmm_map(NULL, TABLE_SIZE * sizeof(page_t *), VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
-	__assert(table);
-	memset(table, 0, TABLE_SIZE * sizeof(page_t *));
+	MUTEX_INIT(&readaheadmutex);
+	MUTEX_INIT(&windowmutex);
+	EVENT_INITHEADER(&cleanevent);
+
+	dirtybackground = pmm_totalpages() * DIRTY_BACKGROUND_PERCENT / 100;
+	dirtyhard = pmm_totalpages() * DIRTY_HARD_PERCENT / 100;
+	if (dirtyhard / DIRTY_DEVICE_SHARE <= dirtybackground / DIRTY_DEVICE_SHARE)
+		dirtyhard = dirtybackground + DIRTY_DEVICE_SHARE;
+
+	// only the address space is reserved, the pages are mapped in while writing
+	window = vmm_map(NULL, CLUSTER_MAX * PAGE_SIZE, 0, WINDOW_FLAGS, NULL);
+	__assert(window);
 
 	SEMAPHORE_INIT(&sync, 0);
 	writerthread = sched_newthread(writer, PAGE_SIZE * 16, 1, NULL, NULL);
 	__assert(writerthread);
 	sched_queue(writerthread);
+	SEMAPHORE_INIT(&readaheadsem, 0);
+	readaheadthread = sched_newthread(readaheadworker, PAGE_SIZE * 16, 1, NULL, NULL);
+	__assert(readaheadthread);
+	sched_queue(readaheadthread);
 	vmmcache_sync();
 	EVENT_INITHEADER(&syncevent);
 	EVENT_INITHEADER(&pagereadyevent);
+	shrinker_register(&cacheshrinker);
+	shrinker_register(&mappedshrinker);
 }
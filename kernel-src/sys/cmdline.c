@@ -61,13 +61,13 @@ void cmdline_parse() {
 			char *valuep = &buffer[i + keylen + 1];
 			size_t valuelen = strlen(valuep);
 
-			char *value = alloc(valuelen) + 1;
+			char *value = zalloc(valuelen) + 1;
 			__assert(value);
 			strcpy(value, valuep);
 			__assert(hashtable_set(&pairtable, value, &buffer[i], keylen, true) == 0);
 			i += valuelen + 1;
 		} else {
-			char *value = alloc(keylen + 1);
+			char *value = zalloc(keylen + 1);
 			__assert(value);
 			strcpy(value, &buffer[i]);
 			__assert(hashtable_set(&pairtable, value, &buffer[i], keylen, true) == 0);
@@ -162,7 +162,7 @@ int elf_load(vnode_t *vnode, void *base, void **entry, char **interpreter, auxv6
 	__assert(header.phsize == sizeof(elfph64_t));
 
 	size_t phtablesize = sizeof(elfph64_t) * header.phcount;
-	elfph64_t *headers = alloc(phtablesize);
+	elfph64_t *headers = zalloc(phtablesize);
 	if (headers == NULL)
 		return ENOMEM;
 
@@ -190,7 +190,7 @@ int elf_load(vnode_t *vnode, void *base, void **entry, char **interpreter, auxv6
 	}
 
 	if (interpreterph) {
-		char *buff = alloc(interpreterph->fsize);
+		char *buff = zalloc(interpreterph->fsize);
 		if (buff == NULL) {
 			err = ENOMEM;
 			goto cleanup;
@@ -4,6 +4,7 @@
 #include <arch/cpu.h>
 #include <spinlock.h>
 #include <kernel/vmm.h>
+#include <kernel/pmm.h>
 #include <kernel/alloc.h>
 #include <errno.h>
 #include <kernel/elf.h>
@@ -12,6 +13,8 @@
 #include <kernel/devfs.h>
 #include <kernel/jobctl.h>
 #include <kernel/cmdline.h>
+#include <arch/smp.h>
+#include <kernel/timekeeper.h>
 
 #define QUANTUM_US 100000
 #define SCHEDULER_STACK_SIZE PAGE_SIZE * 16
@@ -20,15 +23,72 @@ static scache_t *threadcache;
 static scache_t *processcache;
 
 #define RUNQUEUE_COUNT 64
+// how many ticks apart a cpu looks for an imbalance, and how many more queued threads the busiest cpu needs to have for one to be pulled over
+#define BALANCE_TICKS 4
+#define BALANCE_IMBALANCE 2
+
+// user threads are scheduled fairly by virtual runtime, as a class that sits at FAIR_PRIORITY among the kernel priorities.
+// the latency target is the period in which every queued fair thread should get to run, split into slices by weight
+#define FAIR_PRIORITY 1
+#define FAIR_LATENCY_US 20000
+#define FAIR_MIN_SLICE_US 3000
+// how far behind a woken thread has to be to preempt the running one
+#define FAIR_WAKEUP_GRANULARITY_US 1000
+// how far ahead of the others a thread that slept can be placed
+#define FAIR_SLEEPER_CREDIT_US (FAIR_LATENCY_US / 2)
+#define FAIR_NICE0_WEIGHT 1024
+
+// each nice level is about 10% more or less cpu time than the one next to it
+static const unsigned long niceweights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
 
 typedef struct {
 	thread_t *list;
 	thread_t *last;
 } rqueue_t;
 
-static rqueue_t runqueue[RUNQUEUE_COUNT];
-static uint64_t runqueuebitmap;
-static spinlock_t runqueuelock;
+// a bit in the bitmap is set for every priority with a non empty queue
+typedef struct {
+	rqueue_t queues[RUNQUEUE_COUNT];
+	uint64_t bitmap;
+} rqset_t;
+
+// each cpu has its own run queues. a thread is queued on the cpu it is pinned to, and an unpinned one
+// can be stolen by other cpus when they run out of work or when balancing.
+// pinned threads are kept apart so that stealing never has to skip over them
+typedef struct {
+	spinlock_t lock;
+	rqset_t shared;
+	rqset_t pinned;
+	// heaps of the queued fair threads, ordered by virtual runtime
+	thread_t *fairshared;
+	thread_t *fairpinned;
+	uintmax_t minvruntime;
+	unsigned long fairweight;
+	// read without the lock when looking for the busiest cpu, so they are only a hint there
+	size_t count;
+	size_t sharedcount;
+	size_t ticks;
+	cpu_t *cpu;
+	// set while a reschedule ipi is on its way, so a burst of wakeups only sends one
+	bool kicked;
+	// the tick only runs while there are threads queued behind the running one. a cpu that queues
+	// a thread on another one with the tick stopped kicks it so the tick gets started again
+	bool ticking;
+	dpc_t dpc;
+} __attribute__((aligned(64))) cpurq_t;
+
+static cpurq_t runqueues[ARCH_MAX_CPUS];
+// a bit is set for every cpu running its idle thread
+static uint64_t idlecpus;
 static hashtable_t pidtable;
 // not defined as static because its acquired/released from a macro in kernel/scheduler.h
 mutex_t sched_pidtablemutex;
@@ -87,7 +147,7 @@ proc_t *sched_newproc() {
 	itimer_init(&proc->timer.profiling, profdpc, proc);
 	SPINLOCK_INIT(proc->threadlistlock);
 
-	proc->fd = alloc(sizeof(fd_t) * 3);
+	proc->fd = zalloc(sizeof(fd_t) * 3);
 	if (proc->fd == NULL) {
 		slab_free(processcache, proc);
 		return NULL;
@@ -128,6 +188,7 @@ thread_t *sched_newthread(void *ip, size_t kstacksize, int priority, proc_t *pro
 	thread->vmmctx = proc ? NULL : &vmm_kernelctx;
 	thread->proc = proc;
 	thread->priority = priority;
+	thread->weight = FAIR_NICE0_WEIGHT;
 	thread->kernelstacksize = kstacksize;
 	if (proc) {
 		// each thread holds one reference to proc
@@ -155,129 +216,494 @@ void sched_destroyproc(proc_t *proc) {
 	slab_free(processcache, proc);
 }
 
-static thread_t *getinrunqueue(rqueue_t *rq) {
-	thread_t *thread = rq->list;
+#define LOCALRQ() (&runqueues[_cpu()->number])
 
-	while (thread) {
-		if (thread->cputarget == NULL || thread->cputarget == _cpu())
-			break;
+// a queued thread can't change its cputarget, as only the running thread sets it for itself
+static inline rqset_t *getrqset(cpurq_t *rq, thread_t *thread) {
+	return thread->cputarget ? &rq->pinned : &rq->shared;
+}
+
+static inline bool isfair(thread_t *thread) {
+	return thread->proc != NULL;
+}
+
+// signed difference so the comparison keeps working if the virtual runtime wraps around
+static inline bool vbefore(uintmax_t a, uintmax_t b) {
+	return (intmax_t)(a - b) < 0;
+}
+
+static inline time_t nowus() {
+	timespec_t ts = timekeeper_timefromboot();
+	return ts.s * 1000000 + ts.ns / 1000;
+}
+
+// the fair queues are pairing heaps, cheap to insert in and with the smallest virtual runtime always at the root
+static thread_t *heapmeld(thread_t *a, thread_t *b) {
+	if (a == NULL)
+		return b;
 
-		thread = thread->next;
+	if (b == NULL)
+		return a;
+
+	if (vbefore(b->vruntime, a->vruntime)) {
+		thread_t *tmp = a;
+		a = b;
+		b = tmp;
 	}
 
-	if (thread) {
-		if (thread->prev)
-			thread->prev->next = thread->next;
-		else
-			rq->list = thread->next;
+	b->heapsibling = a->heapchild;
+	a->heapchild = b;
+	return a;
+}
+
+// returns the new root after removing the old one, melding its children in pairs and then the pairs together
+static thread_t *heappop(thread_t *root) {
+	thread_t *list = root->heapchild;
+	thread_t *paired = NULL;
 
-		if (thread->next)
-			thread->next->prev = thread->prev;
-		else
-			rq->last = thread->prev;
+	while (list) {
+		thread_t *a = list;
+		thread_t *b = a->heapsibling;
+		list = b ? b->heapsibling : NULL;
+
+		a->heapsibling = NULL;
+		if (b)
+			b->heapsibling = NULL;
+
+		thread_t *melded = heapmeld(a, b);
+		melded->heapsibling = paired;
+		paired = melded;
 	}
 
-	return thread;
+	thread_t *newroot = NULL;
+	while (paired) {
+		thread_t *next = paired->heapsibling;
+		paired->heapsibling = NULL;
+		newroot = heapmeld(newroot, paired);
+		paired = next;
+	}
+
+	return newroot;
 }
 
-static thread_t *runqueuenext(int minprio) {
-	bool intstate = interrupt_set(false);
+// the heap with the fair thread that should run next, or NULL
+static thread_t **fairheap(cpurq_t *rq, bool stealing) {
+	thread_t **heap = rq->fairshared ? &rq->fairshared : NULL;
+	if (stealing == false && rq->fairpinned && (heap == NULL || vbefore(rq->fairpinned->vruntime, (*heap)->vruntime)))
+		heap = &rq->fairpinned;
+
+	return heap;
+}
+
+// virtual runtimes only mean something next to the minimum of the queue they were accounted on, so they are carried over
+// as the distance from it. a thread waking up is placed at most FAIR_SLEEPER_CREDIT_US before the minimum
+static void fairplace(cpurq_t *rq, thread_t *thread, bool waking) {
+	intmax_t lag = 0;
+	if (thread->vruntimecpu) {
+		cpurq_t *oldrq = &runqueues[thread->vruntimecpu->number];
+		lag = (intmax_t)(thread->vruntime - __atomic_load_n(&oldrq->minvruntime, __ATOMIC_RELAXED));
+	}
+
+	if (waking && lag < -FAIR_SLEEPER_CREDIT_US)
+		lag = -FAIR_SLEEPER_CREDIT_US;
+
+	thread->vruntime = __atomic_load_n(&rq->minvruntime, __ATOMIC_RELAXED) + lag;
+	thread->vruntimecpu = rq->cpu;
+}
+
+// accounts the time the current thread ran since it was switched in or last charged
+static void charge(cpurq_t *rq, thread_t *thread) {
+	time_t now = nowus();
+	time_t delta = now - thread->runstart;
+	thread->runstart = now;
+
+	if (isfair(thread) == false)
+		return;
+
+	thread->vruntime += delta * FAIR_NICE0_WEIGHT / thread->weight;
+
+	// the minimum only ever moves forwards, following the smallest of the running and queued threads
+	uintmax_t min = thread->vruntime;
+	thread_t **heap = fairheap(rq, false);
+	if (heap && vbefore((*heap)->vruntime, min))
+		min = (*heap)->vruntime;
+
+	if (vbefore(rq->minvruntime, min))
+		__atomic_store_n(&rq->minvruntime, min, __ATOMIC_RELAXED);
+}
+
+// the latency target split between the thread and the fair threads queued behind it by weight
+static time_t fairslice(cpurq_t *rq, thread_t *thread) {
+	unsigned long total = __atomic_load_n(&rq->fairweight, __ATOMIC_RELAXED) + thread->weight;
+	time_t slice = FAIR_LATENCY_US * thread->weight / total;
+	return slice < FAIR_MIN_SLICE_US ? FAIR_MIN_SLICE_US : slice;
+}
+
+// the highest priority (lowest number) up to minprio with threads queued, or -1
+static inline int firstprio(rqset_t *set, int minprio) {
+	uint64_t bitmap = set->bitmap;
+	if (minprio < RUNQUEUE_COUNT - 1)
+		bitmap &= ((uint64_t)1 << (minprio + 1)) - 1;
+
+	return bitmap ? __builtin_ctzll(bitmap) : -1;
+}
+
+static void runqueueremove(cpurq_t *rq, thread_t *thread) {
+	rqset_t *set = getrqset(rq, thread);
+	rqueue_t *queue = &set->queues[thread->priority];
+
+	if (thread->prev)
+		thread->prev->next = thread->next;
+	else
+		queue->list = thread->next;
+
+	if (thread->next)
+		thread->next->prev = thread->prev;
+	else
+		queue->last = thread->prev;
+
+	if (queue->list == NULL)
+		set->bitmap &= ~((uint64_t)1 << thread->priority);
+
+	if (set == &rq->shared)
+		--rq->sharedcount;
 
+	--rq->count;
+	thread->flags &= ~SCHED_THREAD_FLAGS_QUEUED;
+}
+
+// takes the first thread with a priority up to minprio off the queues. threads pinned to the cpu are left alone when stealing.
+// if against is a fair thread, a fair thread is only taken if it is behind it in virtual runtime
+static thread_t *runqueuetake(cpurq_t *rq, int minprio, bool stealing, thread_t *against) {
+	int sharedprio = firstprio(&rq->shared, minprio);
+	int pinnedprio = stealing ? -1 : firstprio(&rq->pinned, minprio);
 	thread_t *thread = NULL;
+	int prio = -1;
+
+	if (pinnedprio != -1 && (sharedprio == -1 || pinnedprio <= sharedprio)) {
+		thread = rq->pinned.queues[pinnedprio].list;
+		prio = pinnedprio;
+	} else if (sharedprio != -1) {
+		thread = rq->shared.queues[sharedprio].list;
+		prio = sharedprio;
+	}
 
-	if (runqueuebitmap == 0)
-		goto leave;
+	thread_t **heap = minprio >= FAIR_PRIORITY ? fairheap(rq, stealing) : NULL;
+	if (heap && against && isfair(against) && vbefore((*heap)->vruntime, against->vruntime) == false)
+		heap = NULL;
 
-	// TODO use the bitmap for this
-	for (int i = 0; i < RUNQUEUE_COUNT && i <= minprio && thread == NULL; ++i) {
-		thread = getinrunqueue(&runqueue[i]);
-		if (thread && runqueue[i].list == NULL)
-			runqueuebitmap &= ~((uint64_t)1 << i);
+	// kernel threads of the same priority go before the fair class
+	if (heap && (thread == NULL || prio > FAIR_PRIORITY)) {
+		thread = *heap;
+		*heap = heappop(thread);
+
+		if (heap == &rq->fairshared)
+			--rq->sharedcount;
+
+		--rq->count;
+		rq->fairweight -= thread->weight;
+		thread->flags &= ~SCHED_THREAD_FLAGS_QUEUED;
+		return thread;
 	}
 
 	if (thread)
-		thread->flags &= ~SCHED_THREAD_FLAGS_QUEUED;
+		runqueueremove(rq, thread);
 
-	leave:
-	interrupt_set(intstate);
 	return thread;
 }
 
-static __attribute__((noreturn)) void switchthread(thread_t *thread) {
-	interrupt_set(false);
-	thread_t* current = _cpu()->thread;
-	
-	_cpu()->thread = thread;
+// the other cpu with the most threads that could be moved off of it
+static cpurq_t *busiestrq(cpurq_t *rq) {
+	cpurq_t *busiest = NULL;
+	size_t busiestcount = 0;
 
-	if(current == NULL || thread->vmmctx != current->vmmctx)
-		vmm_switchcontext(thread->vmmctx);
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+		size_t count = __atomic_load_n(&runqueues[i].sharedcount, __ATOMIC_RELAXED);
+		if (&runqueues[i] != rq && count > busiestcount) {
+			busiest = &runqueues[i];
+			busiestcount = count;
+		}
+	}
 
-	_cpu()->intstatus = ARCH_CONTEXT_INTSTATUS(&thread->context);
-	thread->cpu = _cpu();
-	// XXX make the locking of the flags field better, candidate for a r/w lock
-	spinlock_acquire(&runqueuelock);
-	if (current)
-		current->flags &= ~SCHED_THREAD_FLAGS_RUNNING;
+	return busiest;
+}
 
-	__assert((thread->flags & SCHED_THREAD_FLAGS_RUNNING) == 0);
+// the lock of rq is held, so the other one is only tried as to not deadlock with a cpu stealing from this one
+static thread_t *steal(cpurq_t *rq, int minprio) {
+	cpurq_t *busiest = busiestrq(rq);
+	if (busiest == NULL || spinlock_try(&busiest->lock) == false)
+		return NULL;
 
-	if (current && current->flags & SCHED_THREAD_FLAGS_SLEEP)
-		spinlock_release(&current->sleeplock);
+	thread_t *thread = runqueuetake(busiest, minprio, true, NULL);
+	spinlock_release(&busiest->lock);
 
-	thread->flags |= SCHED_THREAD_FLAGS_RUNNING;
-	__assert((thread->flags & SCHED_THREAD_FLAGS_QUEUED) == 0);
-	spinlock_release(&runqueuelock);
+	if (thread && isfair(thread))
+		fairplace(rq, thread, false);
 
-	void *schedulerstack = _cpu()->schedulerstack;
-	__assert(!((void *)thread->context.rsp < schedulerstack && (void *)thread->context.rsp >= (schedulerstack - SCHEDULER_STACK_SIZE)));
+	return thread;
+}
 
-	ARCH_CONTEXT_SWITCHTHREAD(thread);
-	__builtin_unreachable();
+// called with the lock of rq held and interrupts disabled
+static thread_t *runqueuenext(cpurq_t *rq, int minprio, bool cansteal, thread_t *against) {
+	thread_t *thread = runqueuetake(rq, minprio, false, against);
+	if (thread == NULL && cansteal)
+		thread = steal(rq, minprio);
+
+	return thread;
 }
 
-static void runqueueinsert(thread_t *thread) {
+static void runqueueinsert(cpurq_t *rq, thread_t *thread, bool waking) {
 	__assert((thread->flags & SCHED_THREAD_FLAGS_RUNNING) == 0);
 	thread->flags |= SCHED_THREAD_FLAGS_QUEUED;
 
-	runqueuebitmap |= ((uint64_t)1 << thread->priority);
+	if (isfair(thread)) {
+		fairplace(rq, thread, waking);
+		thread->weight = niceweights[__atomic_load_n(&thread->proc->nice, __ATOMIC_RELAXED) - SCHED_NICE_MIN];
+		thread->heapchild = NULL;
+		thread->heapsibling = NULL;
+
+		thread_t **heap = thread->cputarget ? &rq->fairpinned : &rq->fairshared;
+		*heap = heapmeld(*heap, thread);
+
+		if (heap == &rq->fairshared)
+			++rq->sharedcount;
+
+		++rq->count;
+		rq->fairweight += thread->weight;
+		return;
+	}
+
+	rqset_t *set = getrqset(rq, thread);
+	rqueue_t *queue = &set->queues[thread->priority];
+	set->bitmap |= ((uint64_t)1 << thread->priority);
 
-	thread->prev = runqueue[thread->priority].last;
+	thread->prev = queue->last;
 	if (thread->prev)
 		thread->prev->next = thread;
 	else
-		runqueue[thread->priority].list = thread;
+		queue->list = thread;
 
 	thread->next = NULL;
-	runqueue[thread->priority].last = thread;
+	queue->last = thread;
+
+	if (set == &rq->shared)
+		++rq->sharedcount;
+
+	++rq->count;
 }
 
-void sched_queue(thread_t *thread) {
+// the other cpu with the least threads queued
+static cpurq_t *idlestrq(cpurq_t *rq) {
+	cpurq_t *idlest = NULL;
+	size_t idlestcount = 0;
+
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i) {
+		size_t count = __atomic_load_n(&runqueues[i].count, __ATOMIC_RELAXED);
+		if (&runqueues[i] != rq && runqueues[i].cpu && (idlest == NULL || count < idlestcount)) {
+			idlest = &runqueues[i];
+			idlestcount = count;
+		}
+	}
+
+	return idlest;
+}
+
+static void resched(cpurq_t *rq, thread_t *thread);
+
+// pulls a thread over from the busiest cpu if it is far enough ahead of this one, or otherwise pushes one to the idlest cpu
+// if this one is far enough ahead of it. the push is there for cpus that have their tick stopped and so never get to pull
+static void balance(cpurq_t *rq) {
+	cpurq_t *busiest = busiestrq(rq);
+	if (busiest && __atomic_load_n(&busiest->count, __ATOMIC_RELAXED) >= rq->count + BALANCE_IMBALANCE && spinlock_try(&busiest->lock)) {
+		thread_t *thread = NULL;
+		if (busiest->count >= rq->count + BALANCE_IMBALANCE)
+			thread = runqueuetake(busiest, RUNQUEUE_COUNT, true, NULL);
+
+		spinlock_release(&busiest->lock);
+
+		if (thread) {
+			runqueueinsert(rq, thread, false);
+			return;
+		}
+	}
+
+	cpurq_t *idlest = idlestrq(rq);
+	if (idlest == NULL || rq->count < __atomic_load_n(&idlest->count, __ATOMIC_RELAXED) + BALANCE_IMBALANCE)
+		return;
+
+	thread_t *thread = runqueuetake(rq, RUNQUEUE_COUNT, true, NULL);
+	if (thread == NULL)
+		return;
+
+	if (spinlock_try(&idlest->lock) == false) {
+		runqueueinsert(rq, thread, false);
+		return;
+	}
+
+	runqueueinsert(idlest, thread, false);
+	spinlock_release(&idlest->lock);
+	resched(idlest, thread);
+}
+
+// whether the thread should run before whatever the cpu is running right now
+static bool shouldpreempt(cpu_t *cpu, thread_t *thread) {
+	thread_t *running = __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED);
+	if (running == NULL)
+		return false;
+
+	if (running == cpu->idlethread)
+		return true;
+
+	if (thread->priority != running->priority)
+		return thread->priority < running->priority;
+
+	// within the fair class, only preempt a thread that is far enough ahead
+	return isfair(thread) && isfair(running) && vbefore(thread->vruntime + FAIR_WAKEUP_GRANULARITY_US, running->vruntime);
+}
+
+// pinned threads go to their cpu. others go back to the cpu they last ran on as it likely still has them in cache,
+// unless it is busy with something that won't give way to the thread and another cpu is idle
+static cpurq_t *selectrq(thread_t *thread) {
+	if (thread->cputarget)
+		return &runqueues[thread->cputarget->number];
+
+	cpu_t *cpu = thread->cpu ? thread->cpu : _cpu();
+	if (shouldpreempt(cpu, thread) == false) {
+		uint64_t idle = __atomic_load_n(&idlecpus, __ATOMIC_RELAXED);
+		if (idle)
+			return &runqueues[__builtin_ctzll(idle)];
+	}
+
+	return &runqueues[cpu->number];
+}
+
+static void preempt(context_t *context);
+
+static void reschedhook(context_t *context, dpcarg_t) {
+	interrupt_set(false);
+	preempt(context);
+}
+
+static void reschedisr(isr_t *, context_t *) {
+	cpurq_t *rq = LOCALRQ();
+	__atomic_store_n(&rq->kicked, false, __ATOMIC_SEQ_CST);
+	dpc_enqueue(&rq->dpc, reschedhook, NULL);
+}
+
+// makes the cpu of rq pick up the thread right away if it should run before what the cpu is running now,
+// or go through the scheduler to start its tick again if it is stopped
+static void resched(cpurq_t *rq, thread_t *thread) {
+	cpu_t *cpu = rq->cpu;
+	// the current thread being put back on its own cpu, the switch that follows takes care of the tick
+	if (cpu == _cpu() && thread == cpu->thread)
+		return;
+
+	// pairs with updatetick. the count went up with a plain store, which without the fence could still be
+	// in the store buffer while the flag is read, and then neither side would see the other
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (shouldpreempt(cpu, thread) == false && __atomic_load_n(&rq->ticking, __ATOMIC_SEQ_CST))
+		return;
+
+	if (cpu == _cpu())
+		dpc_enqueue(&rq->dpc, reschedhook, NULL);
+	else if (__atomic_exchange_n(&rq->kicked, true, __ATOMIC_SEQ_CST) == false)
+		arch_smp_sendipi(cpu, &_cpu()->isr[ARCH_SMP_RESCHED_VECTOR], ARCH_SMP_IPI_TARGET, false);
+}
+
+static void timerhook(context_t *context, dpcarg_t arg);
+
+// the tick is only needed to share the cpu between the running thread and the ones queued behind it.
+// it is armed again on every switch, as the length of a fair slice depends on what is queued
+static void updatetick(cpurq_t *rq, thread_t *thread) {
+	bool idle = thread == _cpu()->idlethread;
+	bool needed = idle == false && __atomic_load_n(&rq->count, __ATOMIC_SEQ_CST) > 0;
+
+	if (needed) {
+		if (rq->ticking)
+			timer_remove(_cpu()->timer, &_cpu()->schedtimerentry);
+
+		// a tick from before could still be pending, and timer_insert clears the entry
+		dpc_dequeue(&_cpu()->schedtimerentry.dpc);
+		timer_insert(_cpu()->timer, &_cpu()->schedtimerentry, timerhook, NULL, isfair(thread) ? fairslice(rq, thread) : QUANTUM_US, true);
+		__atomic_store_n(&rq->ticking, true, __ATOMIC_SEQ_CST);
+	} else if (needed == false && rq->ticking) {
+		__atomic_store_n(&rq->ticking, false, __ATOMIC_SEQ_CST);
+		// a thread queued before the store saw the tick running and didn't kick this cpu
+		if (idle == false && __atomic_load_n(&rq->count, __ATOMIC_SEQ_CST) > 0) {
+			__atomic_store_n(&rq->ticking, true, __ATOMIC_SEQ_CST);
+			return;
+		}
+
+		timer_remove(_cpu()->timer, &_cpu()->schedtimerentry);
+	}
+}
+
+// the caller has already made the current thread available to be queued, so it could be running on another cpu by now
+static __attribute__((noreturn)) void switchthread(thread_t *thread) {
+	interrupt_set(false);
+	_cpu()->thread = thread;
+
+	if (thread->vmmctx != _cpu()->vmmctx)
+		vmm_switchcontext(thread->vmmctx);
+
+	_cpu()->intstatus = ARCH_CONTEXT_INTSTATUS(&thread->context);
+	thread->cpu = _cpu();
+
+	uint64_t cpubit = (uint64_t)1 << _cpu()->number;
+	bool wasidle = __atomic_load_n(&idlecpus, __ATOMIC_RELAXED) & cpubit;
+	if (thread == _cpu()->idlethread && wasidle == false)
+		__atomic_or_fetch(&idlecpus, cpubit, __ATOMIC_SEQ_CST);
+	else if (thread != _cpu()->idlethread && wasidle)
+		__atomic_and_fetch(&idlecpus, ~cpubit, __ATOMIC_SEQ_CST);
+
+	// the thread was taken off a run queue by this cpu (or is its idle thread), so nothing else is touching it
+	__assert((thread->flags & SCHED_THREAD_FLAGS_RUNNING) == 0);
+	__assert((thread->flags & SCHED_THREAD_FLAGS_QUEUED) == 0);
+	thread->flags |= SCHED_THREAD_FLAGS_RUNNING;
+	thread->runstart = nowus();
+
+	updatetick(LOCALRQ(), thread);
+
+	void *schedulerstack = _cpu()->schedulerstack;
+	__assert(!((void *)thread->context.rsp < schedulerstack && (void *)thread->context.rsp >= (schedulerstack - SCHEDULER_STACK_SIZE)));
+
+	ARCH_CONTEXT_SWITCHTHREAD(thread);
+	__builtin_unreachable();
+}
+
+static void queue(thread_t *thread, bool waking) {
 	bool intstate = interrupt_set(false);
-	spinlock_acquire(&runqueuelock);
+	cpurq_t *rq = selectrq(thread);
+	spinlock_acquire(&rq->lock);
 
 	// maybe instead of an assert, a simple return would suffice as the thread would already be queued anyways
 	__assert((thread->flags & SCHED_THREAD_FLAGS_QUEUED) == 0 && (thread->flags & SCHED_THREAD_FLAGS_RUNNING) == 0);
 
-	runqueueinsert(thread);
+	runqueueinsert(rq, thread, waking);
 
-	spinlock_release(&runqueuelock);
+	spinlock_release(&rq->lock);
+	resched(rq, thread);
 	interrupt_set(intstate);
-	// TODO yield if higher priority than current thread (or send another CPU an IPI)
+}
+
+void sched_queue(thread_t *thread) {
+	queue(thread, false);
 }
 
 __attribute__((noreturn)) void sched_stopcurrentthread() {
 	interrupt_set(false);
+	cpurq_t *rq = LOCALRQ();
 
-	spinlock_acquire(&runqueuelock);
 	if (_cpu()->thread)
 		_cpu()->thread->flags &= ~SCHED_THREAD_FLAGS_RUNNING;
 
-	thread_t *next = runqueuenext(0x0fffffff);
+	spinlock_acquire(&rq->lock);
+	thread_t *next = runqueuenext(rq, 0x0fffffff, true, NULL);
+	spinlock_release(&rq->lock);
+
 	if (next == NULL)
 		next = _cpu()->idlethread;
 
-	spinlock_release(&runqueuelock);
-
 	switchthread(next);
 }
 
@@ -358,9 +784,8 @@ static void threadexit_internal(context_t *, void *) {
 	_cpu()->thread = NULL;
 
 	interrupt_set(false);
-	spinlock_acquire(&runqueuelock);
-	thread->flags |= SCHED_THREAD_FLAGS_DEAD;
-	spinlock_release(&runqueuelock);
+	// waitpid polls for this without any lock
+	__atomic_or_fetch(&thread->flags, SCHED_THREAD_FLAGS_DEAD, __ATOMIC_SEQ_CST);
 
 	// because a thread deallocating its own data is a nightmare, thread deallocation and such will be left to whoever frees the proc it's tied to
 	// (likely an exit(2) call)
@@ -496,12 +921,10 @@ void sched_terminateprogram(int status) {
 
 static void yield(context_t *context, void *) {
 	thread_t *thread = _cpu()->thread;
-
-	spinlock_acquire(&runqueuelock);
-
+	cpurq_t *rq = LOCALRQ();
+	bool idle = thread == _cpu()->idlethread;
 	bool sleeping = thread->flags & SCHED_THREAD_FLAGS_SLEEP;
 
-	thread_t *next = runqueuenext(sleeping ? 0x0fffffff : thread->priority);
 	bool gotsignal = false;
 	for (int i = 0; i < NSIG && thread->proc; ++i) {
 		void *action = thread->proc->signals.actions[i].address;
@@ -519,28 +942,36 @@ static void yield(context_t *context, void *) {
 	}
 
 	if (sleeping && (thread->shouldexit || gotsignal) && (thread->flags & SCHED_THREAD_FLAGS_INTERRUPTIBLE)) {
-		sleeping = false;
-		next = NULL;
 		thread->flags &= ~(SCHED_THREAD_FLAGS_SLEEP | SCHED_THREAD_FLAGS_INTERRUPTIBLE);
 		thread->wakeupreason = SCHED_WAKEUP_REASON_INTERRUPTED;
 		spinlock_release(&thread->sleeplock);
+		return;
 	}
 
-	if (next || sleeping) {
-		ARCH_CONTEXT_THREADSAVE(thread, context);
+	// only look at other cpus if this one would otherwise be left idle
+	spinlock_acquire(&rq->lock);
+	if (idle == false)
+		charge(rq, thread);
 
-		thread->flags &= ~SCHED_THREAD_FLAGS_RUNNING;
-		if (sleeping == false)
-			runqueueinsert(thread);
+	thread_t *next = runqueuenext(rq, sleeping ? 0x0fffffff : thread->priority, sleeping || idle, NULL);
+	spinlock_release(&rq->lock);
 
-		if (next == NULL)
-			next = _cpu()->idlethread;
+	if (next == NULL && sleeping == false)
+		return;
 
-		spinlock_release(&runqueuelock);
-		switchthread(next);
-	}
+	ARCH_CONTEXT_THREADSAVE(thread, context);
+	thread->flags &= ~SCHED_THREAD_FLAGS_RUNNING;
+
+	// the idle thread is never queued, it is what runs when nothing else is
+	if (sleeping)
+		spinlock_release(&thread->sleeplock);
+	else if (idle == false)
+		sched_queue(thread);
+
+	if (next == NULL)
+		next = _cpu()->idlethread;
 
-	spinlock_release(&runqueuelock);
+	switchthread(next);
 }
 
 int sched_yield() {
@@ -572,7 +1003,7 @@ bool sched_wakeup(thread_t *thread, int reason) {
 	thread->flags &= ~(SCHED_THREAD_FLAGS_SLEEP | SCHED_THREAD_FLAGS_INTERRUPTIBLE);
 	thread->wakeupreason = reason;
 
-	sched_queue(thread);
+	queue(thread, true);
 	spinlock_release(&thread->sleeplock);
 	interrupt_set(intstate);
 
@@ -625,26 +1056,35 @@ void sched_setroot(vnode_t *new) {
 // once a scheduler dpc gets run, the return context is set to this function using the scheduler stack
 static void dopreempt() {
 	// interrupts are disabled, the thread context is already saved
-	spinlock_acquire(&runqueuelock);
-
+	cpurq_t *rq = LOCALRQ();
 	thread_t *current = _cpu()->thread;
-	thread_t *next = runqueuenext(current->priority);
+	bool idle = current == _cpu()->idlethread;
 
-	current->flags &= ~SCHED_THREAD_FLAGS_PREEMPTED;
-	if (next) {
-		current->flags &= ~SCHED_THREAD_FLAGS_RUNNING;
-		runqueueinsert(current);
-	} else {
-		next = current;
+	spinlock_acquire(&rq->lock);
+	if (rq->ticks >= BALANCE_TICKS) {
+		rq->ticks = 0;
+		balance(rq);
 	}
 
-	spinlock_release(&runqueuelock);
+	if (idle == false)
+		charge(rq, current);
+
+	// a fair thread keeps running until its slice is over, unless one behind it in virtual runtime shows up
+	thread_t *next = runqueuenext(rq, current->priority, idle, current);
+	spinlock_release(&rq->lock);
+
+	current->flags &= ~(SCHED_THREAD_FLAGS_PREEMPTED | SCHED_THREAD_FLAGS_RUNNING);
+	if (next == NULL)
+		next = current;
+	else if (idle == false)
+		sched_queue(current);
+
 	switchthread(next);
 }
 
-static void timerhook(context_t *context, dpcarg_t arg) {
+// called with interrupts disabled from the timer or a reschedule
+static void preempt(context_t *context) {
 	thread_t* current = _cpu()->thread;
-	interrupt_set(false);
 
 	// no need to preempt it again
 	if (current->flags & SCHED_THREAD_FLAGS_PREEMPTED)
@@ -658,11 +1098,19 @@ static void timerhook(context_t *context, dpcarg_t arg) {
 	CTX_IP(context) = (uintptr_t)dopreempt;
 }
 
+static void timerhook(context_t *context, dpcarg_t arg) {
+	interrupt_set(false);
+	++LOCALRQ()->ticks;
+	preempt(context);
+}
+
 static void cpuidlethread() {
 	sched_targetcpu(_cpu());
 	interrupt_set(true);
 	while (1) {
-		CPU_HALT();
+		// spend the idle time zeroing free pages, only halt once there's nothing left to zero
+		if (pmm_zeroidle() == false)
+			CPU_HALT();
 		sched_yield();
 	}
 }
@@ -694,7 +1142,10 @@ void sched_apentry() {
 	_cpu()->idlethread = sched_newthread(cpuidlethread, PAGE_SIZE * 4, 3, NULL, NULL);
 	__assert(_cpu()->idlethread);
 
-	timer_insert(_cpu()->timer, &_cpu()->schedtimerentry, timerhook, NULL, QUANTUM_US, true);
+	LOCALRQ()->cpu = _cpu();
+	interrupt_register(ARCH_SMP_RESCHED_VECTOR, reschedisr, ARCH_EOI, IPL_DPC);
+
+	// the tick gets started by switchthread once there is something to share the cpu with
 	timer_resume(_cpu()->timer);
 	sched_stopcurrentthread();
 }
@@ -712,14 +1163,18 @@ void sched_init() {
 	__assert(_cpu()->schedulerstack);
 	_cpu()->schedulerstack = (void *)((uintptr_t)_cpu()->schedulerstack + SCHEDULER_STACK_SIZE);
 
-	SPINLOCK_INIT(runqueuelock);
+	for (int i = 0; i < ARCH_MAX_CPUS; ++i)
+		SPINLOCK_INIT(runqueues[i].lock);
 
 	_cpu()->idlethread = sched_newthread(cpuidlethread, PAGE_SIZE * 4, 3, NULL, NULL);
 	__assert(_cpu()->idlethread);
 	_cpu()->thread = sched_newthread(NULL, PAGE_SIZE * 32, 0, NULL, NULL);
 	__assert(_cpu()->thread);
 
-	timer_insert(_cpu()->timer, &_cpu()->schedtimerentry, timerhook, NULL, QUANTUM_US, true);
+	LOCALRQ()->cpu = _cpu();
+	interrupt_register(ARCH_SMP_RESCHED_VECTOR, reschedisr, ARCH_EOI, IPL_DPC);
+
+	// the tick gets started by switchthread once there is something to share the cpu with
 	// XXX move this resume to a more appropriate place
 	timer_resume(_cpu()->timer);
 }
@@ -18,7 +18,7 @@ syscallret_t syscall_bind(context_t *, int fd, void *uaddr, size_t addrlen) {
 		return ret;
 	}
 
-	abisockaddr_t *addr = alloc(addrlen);
+	abisockaddr_t *addr = zalloc(addrlen);
 	if (addr == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
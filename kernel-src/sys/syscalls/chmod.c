@@ -26,7 +26,7 @@ syscallret_t syscall_fchmodat(context_t *, int dirfd, char *upath, mode_t mode,
 	if (ret.errno)
 		return ret;
 
-	char *path = alloc(pathlen + 1);
+	char *path = zalloc(pathlen + 1);
 	if (path == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
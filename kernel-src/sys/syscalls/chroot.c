@@ -14,7 +14,7 @@ syscallret_t syscall_chroot(context_t *, char *upath) {
 	if (ret.errno)
 		return ret;
 
-	char *path = alloc(pathlen + 1);
+	char *path = zalloc(pathlen + 1);
 	if (path == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -19,7 +19,7 @@ syscallret_t syscall_connect(context_t *, int fd, abisockaddr_t *uaddr, size_t a
 		return ret;
 	}
 
-	abisockaddr_t *addr = alloc(addrlen);
+	abisockaddr_t *addr = zalloc(addrlen);
 	if (addr == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -39,7 +39,7 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 	if (ret.errno)
 		return ret;
 
-	char *path = alloc(pathlen + 1);
+	char *path = zalloc(pathlen + 1);
 	if (path == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -86,8 +86,8 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 	size_t argoffset = (sbold ? 1 : 0) + (sbarg ? 1 : 0);
 	argsize += argoffset;
 
-	argv = alloc((argsize + 1) * sizeof(char *));
-	envp = alloc((envsize + 1) * sizeof(char *));
+	argv = zalloc((argsize + 1) * sizeof(char *));
+	envp = zalloc((envsize + 1) * sizeof(char *));
 
 	if (argv == NULL || envp == NULL) {
 		ret.errno = ENOMEM;
@@ -95,7 +95,7 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 	}
 
 	if (sbarg) {
-		char *tmp = alloc(strlen(sbarg) + 1);
+		char *tmp = zalloc(strlen(sbarg) + 1);
 		if (tmp == NULL) {
 			ret.errno = ENOMEM;
 			goto error;
@@ -105,7 +105,7 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 	}
 
 	if (sbold) {
-		char *tmp = alloc(strlen(sbold) + 1);
+		char *tmp = zalloc(strlen(sbold) + 1);
 		if (tmp == NULL) {
 			ret.errno = ENOMEM;
 			goto error;
@@ -132,7 +132,7 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 		if (ret.errno)
 			goto error;
 
-		argv[i] = alloc(len + 1);
+		argv[i] = zalloc(len + 1);
 		if (argv[i] == NULL) {
 			ret.errno = ENOMEM;
 			goto error;
@@ -160,7 +160,7 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 		if (ret.errno)
 			goto error;
 
-		envp[i] = alloc(len + 1);
+		envp[i] = zalloc(len + 1);
 		if (envp[i] == NULL) {
 			ret.errno = ENOMEM;
 			goto error;
@@ -15,7 +15,7 @@ syscallret_t syscall_faccessat(context_t *, int dirfd, char *upath, int mode, in
 	if (ret.errno)
 		return ret;
 
-	char *path = alloc(pathlen + 1);
+	char *path = zalloc(pathlen + 1);
 	if (path == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -29,7 +29,7 @@ syscallret_t syscall_fchownat(context_t *, int fd, char *upath, uid_t owner, gid
 		fd_release(file);
 	} else {
 		// chown is done on the file pointed to by the path relative to fd
-		path = alloc(pathlen + 1);
+		path = zalloc(pathlen + 1);
 		if (path == NULL) {
 			ret.errno = ENOMEM;
 			goto cleanup;
@@ -106,7 +106,7 @@ syscallret_t syscall_futex(context_t *, uint32_t *futexp, int op, uint32_t value
 			}
 
 			if (futex == NULL) {
-				futex = alloc(sizeof(futex_t));
+				futex = zalloc(sizeof(futex_t));
 				if (futex == NULL) {
 					ret.errno = ENOMEM;
 					break;
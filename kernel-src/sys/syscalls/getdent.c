@@ -16,7 +16,7 @@ syscallret_t syscall_getdents(context_t *, int dirfd, void *ubuffer, size_t read
 		return ret;
 	}
 
-	dent_t *buffer = alloc(readmax);
+	dent_t *buffer = zalloc(readmax);
 	if (buffer == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
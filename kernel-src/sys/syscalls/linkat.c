@@ -15,13 +15,13 @@ syscallret_t syscall_linkat(context_t *, int olddirfd, char *uoldpath, int newdi
 		return ret;
 	}
 
-	char *oldpath = alloc(oldpathlen + 1);
+	char *oldpath = zalloc(oldpathlen + 1);
 	if (oldpath == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
 	}
 
-	char *newpath = alloc(newpathlen + 1);
+	char *newpath = zalloc(newpathlen + 1);
 	if (newpath == NULL) {
 		free(oldpath);
 		ret.errno = ENOMEM;
@@ -29,11 +29,11 @@ syscallret_t syscall_mount(context_t *context, char *ubacking, char *umountpoint
 	}
 
 	ret.errno = ENOMEM;
-	char *mountpoint = alloc(mountpointlen + 1);
+	char *mountpoint = zalloc(mountpointlen + 1);
 	if (mountpoint == NULL)
 		return ret;
 
-	char *fs = alloc(fslen + 1);
+	char *fs = zalloc(fslen + 1);
 	if (fs == NULL) {
 		free(mountpoint);
 		return ret;
@@ -49,7 +49,7 @@ syscallret_t syscall_mount(context_t *context, char *ubacking, char *umountpoint
 			return ret;
 		}
 
-		backing = alloc(backinglen + 1);
+		backing = zalloc(backinglen + 1);
 		if (backing == NULL) {
 			freeptrs(mountpoint, fs, NULL);
 			return ret;
@@ -18,10 +18,8 @@ syscallret_t syscall_munmap(context_t *ctx, void *addr, size_t length) {
 		return ret;
 	}
 
-	vmm_unmap(addr, length, 0);
-
-	ret.ret = 0;
-	ret.errno = 0;
+	ret.errno = vmm_unmap(addr, length, 0);
+	ret.ret = ret.errno ? -1 : 0;
 
 	return ret;
 }
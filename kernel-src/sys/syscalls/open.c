@@ -19,7 +19,7 @@ syscallret_t syscall_openat(context_t *context, int dirfd, char *path, int flags
 
 	size_t pathsize;
 	ret.errno = usercopy_strlen(path, &pathsize);
-	char *pathbuf = alloc(pathsize + 1);
+	char *pathbuf = zalloc(pathsize + 1);
 	if (pathbuf == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -82,6 +82,8 @@ syscallret_t syscall_openat(context_t *context, int dirfd, char *path, int flags
 		MUTEX_RELEASE(&vnode->sizelock);
 		if (ret.errno)
 			goto cleanup;
+
+		vmm_unmapvnode(vnode, 0);
 	}
 
 	// node refcount is already increased by open
@@ -17,7 +17,7 @@ syscallret_t syscall_poll(context_t *, pollfd_t *fds, size_t nfds, int timeoutms
 	};
 
 	size_t fdsbuffsize = nfds * sizeof(pollfd_t);
-	pollfd_t *fdsbuff = alloc(fdsbuffsize);
+	pollfd_t *fdsbuff = zalloc(fdsbuffsize);
 	if (fdsbuff == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -30,7 +30,7 @@ syscallret_t syscall_poll(context_t *, pollfd_t *fds, size_t nfds, int timeoutms
 	}
 
 	// we need to keep holding the files so another thread doesn't close them and break everything
-	file_t **filebuff = alloc(sizeof(file_t *) * nfds);
+	file_t **filebuff = zalloc(sizeof(file_t *) * nfds);
 	if (filebuff == NULL) {
 		ret.errno = ENOMEM;
 		goto cleanup;
@@ -0,0 +1,65 @@
+#include <kernel/syscalls.h>
+#include <arch/cpu.h>
+#include <errno.h>
+
+// only single processes are supported as targets for now
+static int getproc(int which, int who, proc_t **proc) {
+	if (which != PRIO_PROCESS)
+		return EINVAL;
+
+	if (who == 0) {
+		*proc = _cpu()->thread->proc;
+		PROC_HOLD(*proc);
+	} else {
+		*proc = sched_getprocfrompid(who);
+	}
+
+	return *proc ? 0 : ESRCH;
+}
+
+syscallret_t syscall_getpriority(context_t *, int which, int who) {
+	syscallret_t ret = {
+		.ret = -1
+	};
+
+	proc_t *proc;
+	ret.errno = getproc(which, who, &proc);
+	if (ret.errno)
+		return ret;
+
+	ret.ret = __atomic_load_n(&proc->nice, __ATOMIC_RELAXED);
+	PROC_RELEASE(proc);
+	return ret;
+}
+
+syscallret_t syscall_setpriority(context_t *, int which, int who, int prio) {
+	syscallret_t ret = {
+		.ret = -1
+	};
+
+	proc_t *proc;
+	ret.errno = getproc(which, who, &proc);
+	if (ret.errno)
+		return ret;
+
+	if (prio < SCHED_NICE_MIN)
+		prio = SCHED_NICE_MIN;
+	else if (prio > SCHED_NICE_MAX)
+		prio = SCHED_NICE_MAX;
+
+	cred_t *cred = &_cpu()->thread->proc->cred;
+
+	// only root can touch other users' processes or lower the nice value
+	if (cred->uid != 0 && cred->uid != proc->cred.uid) {
+		ret.errno = EPERM;
+	} else if (cred->uid != 0 && prio < proc->nice) {
+		ret.errno = EACCES;
+	} else {
+		// the threads pick up the new weight the next time they are queued
+		__atomic_store_n(&proc->nice, prio, __ATOMIC_RELAXED);
+		ret.ret = 0;
+	}
+
+	PROC_RELEASE(proc);
+	return ret;
+}
@@ -1,6 +1,7 @@
 #include <kernel/syscalls.h>
 #include <kernel/vfs.h>
 #include <kernel/file.h>
+#include <kernel/vmmcache.h>
 #include <errno.h>
 
 syscallret_t syscall_pwrite(context_t *context, int fd, void *buffer, size_t size, uintmax_t offset) {
@@ -43,6 +44,8 @@ syscallret_t syscall_pwrite(context_t *context, int fd, void *buffer, size_t siz
 	if (ret.errno)
 		goto cleanup;
 
+	vmmcache_throttle(file->vnode, byteswritten);
+
 	ret.ret = byteswritten;
 	ret.errno = 0;
 cleanup:
@@ -20,13 +20,13 @@ syscallret_t syscall_renameat(context_t *context, int olddirfd, char *uoldpath,
 
 	char *oldcomponent = NULL;
 	char *newcomponent = NULL;
-	char *oldpath = alloc(oldpathlen + 1);
+	char *oldpath = zalloc(oldpathlen + 1);
 	if (oldpath == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
 	}
 
-	char *newpath = alloc(newpathlen + 1);
+	char *newpath = zalloc(newpathlen + 1);
 	if (newpath == NULL) {
 		free(oldpath);
 		ret.errno = ENOMEM;
@@ -54,8 +54,8 @@ syscallret_t syscall_renameat(context_t *context, int olddirfd, char *uoldpath,
 	if (ret.errno)
 		goto cleanup;
 
-	oldcomponent = alloc(strlen(oldpath) + 1);
-	newcomponent = alloc(strlen(newpath) + 1);
+	oldcomponent = zalloc(strlen(oldpath) + 1);
+	newcomponent = zalloc(strlen(newpath) + 1);
 
 	if (oldcomponent == NULL && newcomponent == NULL)
 		goto cleanup;
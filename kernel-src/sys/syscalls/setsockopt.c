@@ -16,7 +16,7 @@ syscallret_t syscall_setsockopt(context_t *, int fd, int level, int optname, voi
 
 	void *buffer = NULL;
 	if (val) {
-		buffer = alloc(len);
+		buffer = zalloc(len);
 		if (buffer == NULL) {
 			ret.errno = ENOMEM;
 			return ret;
@@ -1,5 +1,6 @@
 #include <kernel/syscalls.h>
 #include <mutex.h>
+#include <kernel/vmm.h>
 
 syscallret_t syscall_ftruncate(int fd, size_t size) {
 	syscallret_t ret = {
@@ -22,6 +23,10 @@ syscallret_t syscall_ftruncate(int fd, size_t size) {
 	MUTEX_RELEASE(&file->vnode->sizelock);
 	ret.ret = ret.errno ? -1 : 0;
 
+	// the pages past the new size are out of the cache, but could still be mapped
+	if (ret.errno == 0)
+		vmm_unmapvnode(file->vnode, size);
+
 	cleanup:
 
 	fd_release(file);
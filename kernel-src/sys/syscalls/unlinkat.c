@@ -15,7 +15,7 @@ syscallret_t syscall_unlinkat(context_t *, int dirfd, char *upath, int flags) {
 	if (ret.errno)
 		return ret;
 
-	char *path = alloc(pathlen + 1);
+	char *path = zalloc(pathlen + 1);
 	if (path == NULL) {
 		ret.errno = ENOMEM;
 		return ret;
@@ -30,7 +30,7 @@ syscallret_t syscall_unlinkat(context_t *, int dirfd, char *upath, int flags) {
 	vnode_t *dirnode = NULL;
 	file_t *file = NULL;
 
-	char *component = alloc(pathlen + 1);
+	char *component = zalloc(pathlen + 1);
 	if (component == NULL) {
 		ret.errno = ENOMEM;
 		goto cleanup;
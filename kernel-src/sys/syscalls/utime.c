@@ -40,7 +40,7 @@ syscallret_t syscall_utimensat(context_t *, int fd, char *upath, timespec_t uts[
 		if (ret.errno)
 			goto cleanup;
 
-		path = alloc(pathlen + 1);
+		path = zalloc(pathlen + 1);
 		if (path == NULL) {
 			ret.errno = ENOMEM;
 			goto cleanup;
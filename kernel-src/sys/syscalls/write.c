@@ -1,6 +1,7 @@
 #include <kernel/syscalls.h>
 #include <kernel/vfs.h>
 #include <kernel/file.h>
+#include <kernel/vmmcache.h>
 #include <errno.h>
 
 syscallret_t syscall_write(context_t *context, int fd, void *buffer, size_t size) {
@@ -48,6 +49,8 @@ syscallret_t syscall_write(context_t *context, int fd, void *buffer, size_t size
 	if (ret.errno)
 		goto cleanup;
 
+	vmmcache_throttle(file->vnode, byteswritten);
+
 	file->offset = offset + byteswritten;
 	ret.ret = byteswritten;
 	ret.errno = 0;
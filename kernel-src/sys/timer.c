@@ -166,7 +166,7 @@ uintmax_t timer_remove(timer_t *timer, timerentry_t *entry) {
 }
 
 timer_t *timer_new(time_t ticksperus, void (*arm)(time_t), time_t (*stop)()) {
-	timer_t *timer = alloc(sizeof(timer_t));
+	timer_t *timer = zalloc(sizeof(timer_t));
 	if (timer == NULL)
 		return NULL;
 